@@ -0,0 +1,296 @@
+/*
+ * bench.c - Times what iguassu does most, without a server.
+ *
+ * The model is driven like iguassu.c drives it, with a ModelOps that only
+ * records, so what's measured is the bookkeeping and not the round trips.
+ * Then the ASCII fast path of drw_text, against decoding one codepoint at a
+ * time like it did before. Run it with "make bench".
+ */
+
+/*
+ * Copyright (C) 2023  Gabriel de Brito
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MODEL_IMPLEMENTATION
+#include "model.h"
+#define DRW_IMPLEMENTATION
+#include "drw.h"
+
+#define ITERATIONS 2000
+/* Windows of a program are started by it, so they're CHILD above its pid. */
+#define CHILD (1 << 24)
+#define FIRST_PID 1000
+
+static Model m;
+static ModelRecorder rec;
+static ModelOps ops;
+static unsigned int seed = 1;
+
+static unsigned int rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static long long now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* What iguassu does after every change: make the screen look like the
+ * model. The recorder starts over each time or it would grow forever. */
+static void show(void)
+{
+	rec.n = 0;
+	model_sync(&m, &ops, 0);
+}
+
+/* Instead of /proc: a window's process was started by its program, which
+ * was started by init. */
+static pid_t parent(pid_t p)
+{
+	if (p >= CHILD)
+		return p - CHILD;
+	return p >= FIRST_PID ? 1 : 0;
+}
+
+static int ancestry(void *ctx, pid_t ancestor, pid_t pid)
+{
+	while (pid != ancestor && pid != 0)
+		pid = parent(pid);
+	return pid != 0;
+}
+
+/* n containers of one client each, every other one hidden. */
+static void setup(int n)
+{
+	model_init(&m, 1920);
+	for (int k = 0; k < n; k++)
+		model_new_container(&m, k + 1, NULL, FIRST_PID + k, 0, k % 2);
+	show();
+}
+
+static void teardown(void)
+{
+	while (m.containers != NULL)
+		free(model_remove_client(&m, m.containers, m.containers->clients->id));
+}
+
+static void report(const char *what, int n, long long ns)
+{
+	printf("%-16s %6d %12.1f ns\n", what, n, (double) ns / ITERATIONS);
+}
+
+static void bench_focus_container(int n)
+{
+	long long t, ns = 0;
+
+	setup(n);
+	for (int k = 0; k < ITERATIONS; k++) {
+		Container *c = model_nth(&m, rnd() % n);
+		t = now();
+		model_raise(&m, c);
+		show();
+		ns += now() - t;
+	}
+	teardown();
+	report("focus_container", n, ns);
+}
+
+static void bench_hide(int n)
+{
+	long long t, ns = 0;
+
+	setup(n);
+	for (int k = 0; k < ITERATIONS; k++) {
+		/* Something has to be showing to be hidden. */
+		model_raise(&m, model_nth(&m, rnd() % n));
+		t = now();
+		model_hide(&m, model_current(&m));
+		show();
+		ns += now() - t;
+	}
+	teardown();
+	report("hide", n, ns);
+}
+
+static void bench_unhide_by_idx(int n)
+{
+	long long t, ns = 0;
+
+	setup(n);
+	for (int k = 0; k < ITERATIONS; k++) {
+		int hidden;
+
+		/* And the other way around. */
+		model_hide(&m, model_nth(&m, rnd() % n));
+		hidden = model_n_hidden(&m);
+		t = now();
+		model_raise(&m, model_nth_hidden(&m, rnd() % hidden + 1));
+		show();
+		ns += now() - t;
+	}
+	teardown();
+	report("unhide_by_idx", n, ns);
+}
+
+static void bench_unmanage(int n)
+{
+	long long t, ns = 0;
+
+	setup(n);
+	for (int k = 0; k < ITERATIONS; k++) {
+		Container *c = model_nth(&m, rnd() % n);
+		Window win = c->clients->id;
+		pid_t pid = c->clients->pid;
+
+		t = now();
+		free(model_remove_client(&m, c, win));
+		show();
+		ns += now() - t;
+		/* Back, so there are always n of them. */
+		model_new_container(&m, win, NULL, pid, 0, 0);
+	}
+	teardown();
+	report("unmanage", n, ns);
+}
+
+/* A new window of a random program looking for its container. */
+static void bench_grouping(int n)
+{
+	long long t, ns = 0;
+	Container *c;
+
+	setup(n);
+	for (int k = 0; k < ITERATIONS; k++) {
+		pid_t pid = CHILD + FIRST_PID + rnd() % n;
+
+		t = now();
+		c = model_group(&m, m.desk, NULL, pid, ancestry, NULL);
+		ns += now() - t;
+		if (c == NULL || c->clients->pid != pid - CHILD) {
+			fprintf(stderr, "bench: grouped %d wrong\n", (int) pid);
+			exit(1);
+		}
+	}
+	teardown();
+	report("grouping", n, ns);
+}
+
+/* What drw_text did for every title before ascii_run. */
+static size_t decode_run(const char *s)
+{
+	size_t n = 0;
+	long u;
+
+	while (s[n] && utf8decode(s + n, &u, UTF_SIZ) == 1 && u < 0x80)
+		n++;
+	return n;
+}
+
+/* So the runs aren't optimized away. */
+volatile size_t ascii_sink;
+
+typedef struct AsciiRun {
+	const char *name;
+	size_t (*run)(const char *s);
+} AsciiRun;
+
+/* Strings of random ASCII, sometimes with a two byte character, starting
+ * anywhere so every alignment gets tried. */
+static void check_ascii(AsciiRun *runs, int nruns)
+{
+	char buf[256];
+
+	for (int k = 0; k < 100000; k++) {
+		int off = rnd() % 64, len = rnd() % 160;
+		for (int j = 0; j < len; j++)
+			buf[off + j] = ' ' + rnd() % 95;
+		if (len > 1 && rnd() % 2)
+			memcpy(buf + off + rnd() % (len - 1), "\xc3\xa9", 2);
+		buf[off + len] = '\0';
+		for (int r = 0; r < nruns; r++) {
+			if (runs[r].run(buf + off) != decode_run(buf + off)) {
+				fprintf(stderr, "bench: %s is wrong on \"%s\"\n", runs[r].name, buf + off);
+				exit(1);
+			}
+		}
+	}
+}
+
+static void bench_ascii(AsciiRun *r, size_t len)
+{
+	/* Titles are read from wherever Xlib put them, so not aligned. */
+	char *buf = malloc(len + 2);
+	size_t total = 0, n = (64 << 20) / len;
+	long long t;
+
+	assert(buf != NULL && "Buy more ram lol");
+	for (size_t j = 0; j < len; j++)
+		buf[1 + j] = 'a' + j % 26;
+	buf[1 + len] = '\0';
+
+	t = now();
+	for (size_t k = 0; k < n; k++)
+		total += r->run(buf + 1);
+	t = now() - t;
+	ascii_sink = total;
+
+	printf("%-16s %6zu %12.1f MB/s\n", r->name, len, (double) total * 1000 / t);
+	free(buf);
+}
+
+int main(void)
+{
+	static const int sizes[] = { 10, 100, 10000 };
+	static const size_t lengths[] = { 16, 64, 1024 };
+
+	ops = model_recorder_ops(&rec);
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		bench_focus_container(sizes[s]);
+		bench_unmanage(sizes[s]);
+		bench_hide(sizes[s]);
+		bench_unhide_by_idx(sizes[s]);
+		bench_grouping(sizes[s]);
+	}
+	free(rec.ops);
+
+	AsciiRun runs[4] = {
+		{ "decode", decode_run },
+		{ "ascii_words", ascii_run_words },
+	};
+	int nruns = 2;
+#ifdef ASCII_SSE2
+	runs[nruns++] = (AsciiRun) { "ascii_sse2", ascii_run_sse2 };
+	if (__builtin_cpu_supports("avx2"))
+		runs[nruns++] = (AsciiRun) { "ascii_avx2", ascii_run_avx2 };
+#endif
+	check_ascii(runs, nruns);
+	for (unsigned int s = 0; s < sizeof(lengths) / sizeof(lengths[0]); s++)
+		for (int r = 0; r < nruns; r++)
+			bench_ascii(&runs[r], lengths[s]);
+	return 0;
+}
@@ -24,13 +24,24 @@ static const char *menu_color_f[2] = { "#eaffea", "#448844" };
 
 /* Program to spawn on "new". */
 #define TERMINAL "alacritty"
+/* How long (ms) to wait for something spawned by "new" to show a window before
+ * forgetting it. */
+#define SPAWN_TIMEOUT 10000
+
+/* How many terminals to keep started but not shown, so "New" gives one right
+ * away instead of waiting it to start. 0 disables it. More are only started
+ * while the ones in the pool use less than TERMINAL_POOL_MEMORY kB, guessing
+ * TERMINAL_MEMORY kB for each one until it has a window. */
+#define TERMINAL_POOL 0
+#define TERMINAL_POOL_MEMORY (256 * 1024)
+#define TERMINAL_MEMORY (64 * 1024)
 
 /* This sets the actual menu length. 'm' is usually a quite wide character
  * even for variable fonts so you don't need much to get your desired
  * length. */
 #define MENU_LENGTH "mmmmmmm"
 
-/* There are two keybinds and both need the modmask. */
+/* All keybinds need the modmask. */
 #define MODMASK (Mod4Mask)
 
 #define FULLSCREEN_KEY XK_f
@@ -45,3 +56,99 @@ static const char *menu_color_f[2] = { "#eaffea", "#448844" };
  * (it's impossible to access the menu when a window is fullscreen)
  * 2- Sometimes windows may accidentally hide the entire root and you need
  * to reshape them to access the menu. */
+
+/* Opens the window switcher. It lists windows from the last focused to the
+ * first and filters them by title as you type. Tab and the arrows select,
+ * Return focuses and Escape cancels. */
+#define SWITCHER_KEY XK_Tab
+/* Number of rows shown by the switcher and its length (like MENU_LENGTH). */
+#define SWITCHER_ROWS 10
+#define SWITCHER_LENGTH "mmmmmmmmmmmmmmmmmmmmm"
+
+/* When there are more windows than fit in the screen, the menus scroll with
+ * the wheel or while hovering the arrows, a row every this milliseconds. */
+#define MENU_SCROLL_DELAY 60
+
+/* Uncomment to draw the menus on shared memory, with text rendered by
+ * FreeType instead of the server, so a redraw is a single request. It falls
+ * back to the normal drawing if the server can't do that (e.g. it's remote). */
+/* #define MENU_SHM */
+
+/* Uncomment to show how much CPU and memory the processes of each window use
+ * in the menu of windows. They're read every STATS_INTERVAL ms by a thread of
+ * its own, while the menu is open and for STATS_LINGER ms after. */
+/* #define MENU_STATS */
+#define STATS_INTERVAL 1000
+#define STATS_LINGER 30000
+
+/* Uncomment to show a picture of hidden windows next to them in the main
+ * menu, so ones with the same title can be told apart. A picture is taken
+ * when its window is hidden and, with KEEP_MAPPED, updated at most every
+ * THUMB_INTERVAL ms while the hidden window draws. All of them
+ * together take at most THUMB_BUDGET kB of the server's memory. Needs
+ * XComposite and XDamage (add -lXcomposite -lXdamage to the CLIBS of the
+ * Makefile). */
+/* #define THUMBNAILS */
+#define THUMB_WIDTH 192
+#define THUMB_HEIGHT 120
+#define THUMB_INTERVAL 1000
+#define THUMB_BUDGET 8192
+
+/* Uncomment to get an overview of the desktop with OVERVIEW_KEY: every window
+ * scaled down in a grid, live. Clicking one focuses it, any other click or
+ * key leaves. Needs XComposite, XDamage and XRender (add -lXcomposite
+ * -lXdamage -lXrender to the CLIBS of the Makefile). */
+/* #define OVERVIEW */
+#define OVERVIEW_KEY XK_w
+#define OVERVIEW_BACKGROUND 0x757373
+/* Pixels around each window in the grid. */
+#define OVERVIEW_GAP 16
+
+/* Restarts iguassu (e.g. after installing a new build) without losing
+ * anything. */
+#define RESTART_KEY XK_q
+
+/* Number of desktops, up to 9. The modmask and a number switches to that
+ * desktop, with shift it sends the focused window there. */
+#define DESKTOPS 4
+
+/* While moving or reshaping, the outline is redrawn at most every this
+ * milliseconds, so fast mice don't flood the server. */
+#define DRAG_INTERVAL 4
+
+/* Uncomment to read moves and reshapes from XInput2 instead of the core
+ * pointer, which has subpixel positions and isn't held back by the server.
+ * Needs -lXi in the CLIBS of the Makefile. Not used while recording or
+ * replaying. */
+/* #define XINPUT2 */
+
+/* Uncomment to print how long each phase of the startup takes. */
+/* #define PROFILE */
+
+/* Uncomment to keep every window mapped. Windows behind the top one of their
+ * group are stacked below it and hidden ones are moved out of the screen, so
+ * switching and unhiding don't make them repaint from scratch (or lose their
+ * buffers with a compositor). Uses more memory. */
+/* #define KEEP_MAPPED */
+
+/* The click that focuses a window is also sent to it, so clicking a button
+ * of an unfocused window presses it. Comment out if you want the first click
+ * to only focus. */
+#define CLICK_THROUGH
+
+/* New windows are put in the largest free area of the screen instead of
+ * wherever they ask (usually the corner), unless the user asked for a
+ * position (like with -geometry). Comment out to let them choose. */
+#define AUTO_PLACE
+
+/* Uncomment to focus (and raise) the window the pointer is on, once it stays
+ * there for FOCUS_DELAY milliseconds. */
+/* #define FOCUS_FOLLOWS_MOUSE */
+#define FOCUS_DELAY 150
+
+/* Uncomment to keep a timeline of what iguassu does (events, redraws, waits
+ * on the server...) in memory. Sending it SIGUSR1 writes the last TRACE_SPANS
+ * spans to TRACE_FILE, which chrome://tracing and Perfetto open. */
+/* #define TRACE */
+#define TRACE_SPANS 65536
+#define TRACE_FILE "/tmp/iguassu-trace.json"
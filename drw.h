@@ -63,9 +63,42 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdint.h>
+#include <string.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 
+/* Hooks to time parts of the drawing, as in DRW_SPAN_BEGIN(t); ...;
+ * DRW_SPAN_END(t, "name"). They do nothing unless defined before including. */
+#ifndef DRW_SPAN_BEGIN
+#define DRW_SPAN_BEGIN(v)
+#define DRW_SPAN_END(v, name)
+#endif
+
+/*
+ * Defining DRW_SHM before including makes drawing happen on a shared memory
+ * image, with text rasterized by FreeType, so drw_map is a single request.
+ * If the server doesn't support it, the usual Xlib/Xft path is used.
+ */
+#ifdef DRW_SHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#define DRW_GLYPH_BUCKETS 256
+
+/* 8 bit coverage bitmap of a glyph. */
+typedef struct DrwGlyph {
+	FT_UInt index;
+	int left, top, advance;
+	unsigned int w, h;
+	unsigned char *bits;
+	struct DrwGlyph *next;
+} DrwGlyph;
+#endif
+
 typedef struct {
 	Cursor cursor;
 } Cur;
@@ -76,6 +109,12 @@ typedef struct Fnt {
 	XftFont *xfont;
 	FcPattern *pattern;
 	struct Fnt *next;
+	/* Which ASCII characters the font has, filled on first use. */
+	int ascii_ready;
+	unsigned char ascii[128 / 8];
+#ifdef DRW_SHM
+	DrwGlyph *glyphs[DRW_GLYPH_BUCKETS];
+#endif
 } Fnt;
 
 enum { ColFg, ColBg }; /* Clr scheme index */
@@ -90,6 +129,11 @@ typedef struct {
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+#ifdef DRW_SHM
+	/* NULL when drawing on the drawable. */
+	XImage *img;
+	XShmSegmentInfo shminfo;
+#endif
 } Drw;
 
 /* Drawable abstraction */
@@ -181,6 +225,328 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+/*
+ * Length of the ASCII run at the start of s, up to the terminator. Titles are
+ * almost always plain ASCII, so this checks 32 (AVX2), 16 (SSE2) or 8 bytes at
+ * once for high bits and zeros. Loads are aligned so they never cross into a
+ * page the string isn't in, and the first one just ignores what comes before
+ * s. AVX2 is picked when the CPU has it, even if the rest isn't built for it.
+ * They're inline only so the ones a build doesn't pick don't warn.
+ */
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <immintrin.h>
+#define ASCII_SSE2
+#endif
+
+static inline size_t
+ascii_run_words(const char *s)
+{
+	const unsigned long long ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+	const unsigned char *p = (const unsigned char *) s;
+	unsigned long long v;
+
+	for (; (uintptr_t) p % sizeof(v); p++)
+		if (!*p || *p >= 0x80)
+			return p - (const unsigned char *) s;
+	for (;; p += sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		/* High bits, or the classic "has a zero byte". */
+		if ((v | ((v - ones) & ~v)) & highs)
+			break;
+	}
+	for (; *p && *p < 0x80; p++)
+		;
+	return p - (const unsigned char *) s;
+}
+
+#ifdef ASCII_SSE2
+static inline size_t
+ascii_run_sse2(const char *s)
+{
+	unsigned int skip = (uintptr_t) s % 16;
+	const unsigned char *p = (const unsigned char *) s - skip;
+	unsigned int m;
+	__m128i v;
+
+	for (;; p += 16, skip = 0) {
+		v = _mm_load_si128((const __m128i *) p);
+		m = _mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+		if ((m >>= skip))
+			return p + skip + __builtin_ctz(m) - (const unsigned char *) s;
+	}
+}
+
+__attribute__((target("avx2"))) static inline size_t
+ascii_run_avx2(const char *s)
+{
+	unsigned int skip = (uintptr_t) s % 32;
+	const unsigned char *p = (const unsigned char *) s - skip;
+	unsigned int m;
+	__m256i v;
+
+	for (;; p += 32, skip = 0) {
+		v = _mm256_load_si256((const __m256i *) p);
+		m = _mm256_movemask_epi8(v) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+		if ((m >>= skip))
+			return p + skip + __builtin_ctz(m) - (const unsigned char *) s;
+	}
+}
+#endif
+
+static size_t
+ascii_run(const char *s)
+{
+#if defined(__AVX2__)
+	return ascii_run_avx2(s);
+#elif defined(ASCII_SSE2)
+	static int avx2 = -1;
+
+	if (avx2 < 0) {
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2");
+	}
+	return avx2 ? ascii_run_avx2(s) : ascii_run_sse2(s);
+#else
+	return ascii_run_words(s);
+#endif
+}
+
+static int
+font_has_ascii(Fnt *font, unsigned char c)
+{
+	int i;
+
+	if (!font->ascii_ready) {
+		memset(font->ascii, 0, sizeof(font->ascii));
+		for (i = 0; i < 128; i++)
+			if (XftCharExists(font->dpy, font->xfont, i))
+				font->ascii[i / 8] |= 1 << (i % 8);
+		font->ascii_ready = 1;
+	}
+	return font->ascii[c / 8] & (1 << (c % 8));
+}
+
+#ifdef DRW_SHM
+static int shm_failed;
+
+static int
+shm_error_handler(Display *dpy, XErrorEvent *e)
+{
+	shm_failed = 1;
+	return 0;
+}
+
+static void
+shm_free(Drw *drw)
+{
+	if (!drw->img)
+		return;
+
+	XShmDetach(drw->dpy, &drw->shminfo);
+	XSync(drw->dpy, False);
+	shmdt(drw->shminfo.shmaddr);
+	drw->img->data = NULL;
+	XDestroyImage(drw->img);
+	drw->img = NULL;
+}
+
+/* Leaves img NULL if the server can't attach our memory (e.g. it's remote) or
+ * if the pixels aren't plain 32 bit RGB in our byte order. */
+static void
+shm_create(Drw *drw, unsigned int w, unsigned int h)
+{
+	Visual *vis = DefaultVisual(drw->dpy, drw->screen);
+	union { uint32_t u; unsigned char c[4]; } order = { 1 };
+	int (*handler)(Display *, XErrorEvent *);
+	XImage *img;
+
+	drw->img = NULL;
+	if (!XShmQueryExtension(drw->dpy)
+	    || vis->class != TrueColor
+	    || vis->red_mask != 0xff0000 || vis->green_mask != 0xff00 || vis->blue_mask != 0xff
+	    || ImageByteOrder(drw->dpy) != (order.c[0] ? LSBFirst : MSBFirst))
+		return;
+
+	img = XShmCreateImage(drw->dpy, vis, DefaultDepth(drw->dpy, drw->screen),
+	                      ZPixmap, NULL, &drw->shminfo, w, h);
+	if (!img)
+		return;
+	if (img->bits_per_pixel != 32) {
+		XDestroyImage(img);
+		return;
+	}
+
+	drw->shminfo.shmid = shmget(IPC_PRIVATE, img->bytes_per_line * img->height, IPC_CREAT | 0600);
+	if (drw->shminfo.shmid < 0) {
+		XDestroyImage(img);
+		return;
+	}
+	drw->shminfo.shmaddr = img->data = shmat(drw->shminfo.shmid, NULL, 0);
+	drw->shminfo.readOnly = False;
+	if (img->data == (char *)-1) {
+		shmctl(drw->shminfo.shmid, IPC_RMID, NULL);
+		img->data = NULL;
+		XDestroyImage(img);
+		return;
+	}
+
+	shm_failed = 0;
+	handler = XSetErrorHandler(shm_error_handler);
+	XShmAttach(drw->dpy, &drw->shminfo);
+	XSync(drw->dpy, False);
+	XSetErrorHandler(handler);
+	/* Both sides are attached, so it goes away when both detach. */
+	shmctl(drw->shminfo.shmid, IPC_RMID, NULL);
+
+	if (shm_failed) {
+		shmdt(drw->shminfo.shmaddr);
+		img->data = NULL;
+		XDestroyImage(img);
+		return;
+	}
+	drw->img = img;
+}
+
+static DrwGlyph *
+shm_glyph(Fnt *font, FT_UInt index)
+{
+	DrwGlyph **bucket = &font->glyphs[index % DRW_GLYPH_BUCKETS];
+	DrwGlyph *g;
+	FT_Face face;
+	FT_Bitmap *bm;
+	unsigned int x, y;
+
+	for (g = *bucket; g; g = g->next)
+		if (g->index == index)
+			return g;
+
+	if (!(face = XftLockFace(font->xfont)))
+		return NULL;
+	if (FT_Load_Glyph(face, index, FT_LOAD_RENDER) || !(g = malloc(sizeof(DrwGlyph)))) {
+		XftUnlockFace(font->xfont);
+		return NULL;
+	}
+
+	bm = &face->glyph->bitmap;
+	g->index = index;
+	g->left = face->glyph->bitmap_left;
+	g->top = face->glyph->bitmap_top;
+	g->advance = (face->glyph->advance.x + 32) >> 6;
+	g->w = bm->width;
+	g->h = bm->rows;
+	if (!(g->bits = malloc(g->w * g->h + 1))) {
+		free(g);
+		XftUnlockFace(font->xfont);
+		return NULL;
+	}
+	for (y = 0; y < g->h; y++) {
+		for (x = 0; x < g->w; x++) {
+			if (bm->pixel_mode == FT_PIXEL_MODE_MONO)
+				g->bits[y * g->w + x] = (bm->buffer[y * bm->pitch + x / 8] >> (7 - x % 8)) & 1 ? 255 : 0;
+			else
+				g->bits[y * g->w + x] = bm->buffer[y * bm->pitch + x];
+		}
+	}
+	XftUnlockFace(font->xfont);
+
+	g->next = *bucket;
+	*bucket = g;
+
+	return g;
+}
+
+static void
+shm_glyphs_free(Fnt *font)
+{
+	DrwGlyph *g, *next;
+	size_t i;
+
+	for (i = 0; i < DRW_GLYPH_BUCKETS; i++) {
+		for (g = font->glyphs[i]; g; g = next) {
+			next = g->next;
+			free(g->bits);
+			free(g);
+		}
+	}
+}
+
+static void
+shm_blit(Drw *drw, DrwGlyph *g, int x, int y, Clr *clr)
+{
+	unsigned int r = clr->color.red >> 8, gr = clr->color.green >> 8, b = clr->color.blue >> 8;
+	unsigned int a, gx, gy;
+	uint32_t *row, p;
+	int px, py;
+
+	for (gy = 0; gy < g->h; gy++) {
+		py = y + gy;
+		if (py < 0 || py >= (int)drw->h)
+			continue;
+		row = (uint32_t *)(drw->img->data + py * drw->img->bytes_per_line);
+		for (gx = 0; gx < g->w; gx++) {
+			px = x + gx;
+			if (px < 0 || px >= (int)drw->w || !(a = g->bits[gy * g->w + gx]))
+				continue;
+			p = row[px];
+			row[px] = ((r * a + ((p >> 16) & 0xff) * (255 - a)) / 255) << 16
+			        | ((gr * a + ((p >> 8) & 0xff) * (255 - a)) / 255) << 8
+			        | ((b * a + (p & 0xff) * (255 - a)) / 255);
+		}
+	}
+}
+
+static void
+shm_string(Drw *drw, Clr *clr, Fnt *font, int x, int y, const char *text, size_t len)
+{
+	DrwGlyph *g;
+	long cp;
+	size_t n;
+
+	while (len && (n = utf8decode(text, &cp, len))) {
+		if ((g = shm_glyph(font, XftCharIndex(drw->dpy, font->xfont, cp)))) {
+			shm_blit(drw, g, x + g->left, y - g->top, clr);
+			x += g->advance;
+		}
+		text += n;
+		len -= n;
+	}
+}
+#endif
+
+static void
+drw_fill(Drw *drw, int x, int y, unsigned int w, unsigned int h, Clr *clr)
+{
+#ifdef DRW_SHM
+	uint32_t *row;
+	int i, x2, y2;
+
+	if (drw->img) {
+		x2 = MIN(x + (int)w, (int)drw->w);
+		y2 = MIN(y + (int)h, (int)drw->h);
+		for (y = MAX(y, 0); y < y2; y++) {
+			row = (uint32_t *)(drw->img->data + y * drw->img->bytes_per_line);
+			for (i = MAX(x, 0); i < x2; i++)
+				row[i] = clr->pixel;
+		}
+		return;
+	}
+#endif
+	XSetForeground(drw->dpy, drw->gc, clr->pixel);
+	XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
+}
+
+static void
+drw_string(Drw *drw, XftDraw *d, Clr *clr, Fnt *font, int x, int y, const char *text, size_t len)
+{
+#ifdef DRW_SHM
+	if (drw->img) {
+		shm_string(drw, clr, font, x, y, text, len);
+		return;
+	}
+#endif
+	XftDrawStringUtf8(d, clr, font->xfont, x, y, (XftChar8 *)text, len);
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h)
 {
@@ -196,6 +562,9 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
+#ifdef DRW_SHM
+	shm_create(drw, w, h);
+#endif
 
 	return drw;
 }
@@ -208,6 +577,21 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 
 	drw->w = w;
 	drw->h = h;
+#ifdef DRW_SHM
+	/* The image only grows, as it may be bigger than what is drawn. */
+	if (drw->img) {
+		if (w > (unsigned int)drw->img->width || h > (unsigned int)drw->img->height) {
+			w = MAX(w, (unsigned int)drw->img->width);
+			h = MAX(h, (unsigned int)drw->img->height);
+			shm_free(drw);
+			shm_create(drw, w, h);
+		}
+		if (drw->img)
+			return;
+		w = drw->w;
+		h = drw->h;
+	}
+#endif
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
@@ -216,6 +600,9 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 void
 drw_free(Drw *drw)
 {
+#ifdef DRW_SHM
+	shm_free(drw);
+#endif
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	free(drw);
@@ -275,6 +662,10 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 	font->pattern = pattern;
 	font->h = xfont->ascent + xfont->descent;
 	font->dpy = drw->dpy;
+	font->ascii_ready = 0;
+#ifdef DRW_SHM
+	memset(font->glyphs, 0, sizeof(font->glyphs));
+#endif
 
 	return font;
 }
@@ -286,6 +677,9 @@ xfont_free(Fnt *font)
 		return;
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
+#ifdef DRW_SHM
+	shm_glyphs_free(font);
+#endif
 	XftFontClose(font->dpy, font->xfont);
 	free(font);
 }
@@ -364,11 +758,23 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 {
 	if (!drw || !drw->scheme)
 		return;
-	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
-	if (filled)
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-	else
-		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
+	Clr *clr = &drw->scheme[invert ? ColBg : ColFg];
+
+	if (filled) {
+		drw_fill(drw, x, y, w, h, clr);
+		return;
+	}
+#ifdef DRW_SHM
+	if (drw->img) {
+		drw_fill(drw, x, y, w, 1, clr);
+		drw_fill(drw, x, y + h - 1, w, 1, clr);
+		drw_fill(drw, x, y, 1, h, clr);
+		drw_fill(drw, x + w - 1, y, 1, h, clr);
+		return;
+	}
+#endif
+	XSetForeground(drw->dpy, drw->gc, clr->pixel);
+	XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
 int
@@ -379,7 +785,7 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	unsigned int ew;
 	XftDraw *d = NULL;
 	Fnt *usedfont, *curfont, *nextfont;
-	size_t i, len;
+	size_t i, len, run;
 	int utf8strlen, utf8charlen, render = x || y || w || h;
 	long utf8codepoint = 0;
 	const char *utf8str;
@@ -391,12 +797,15 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
+	DRW_SPAN_BEGIN(span);
 
 	if (!render) {
 		w = ~w;
 	} else {
-		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
+		drw_fill(drw, x, y, w, h, &drw->scheme[invert ? ColFg : ColBg]);
+#ifdef DRW_SHM
+		if (!drw->img)
+#endif
 		d = XftDrawCreate(drw->dpy, drw->drawable,
 		                  DefaultVisual(drw->dpy, drw->screen),
 		                  DefaultColormap(drw->dpy, drw->screen));
@@ -410,6 +819,17 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		utf8str = text;
 		nextfont = NULL;
 		while (*text) {
+			/* Whole ASCII runs the primary font has go in one step. */
+			if (usedfont == drw->fonts && !charexists) {
+				run = ascii_run(text);
+				for (i = 0; i < run && font_has_ascii(usedfont, text[i]); i++)
+					;
+				utf8strlen += i;
+				text += i;
+				if (!*text)
+					break;
+			}
+
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
 			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
 				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
@@ -445,8 +865,8 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 
 				if (render) {
 					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
+					drw_string(drw, d, &drw->scheme[invert ? ColBg : ColFg],
+					           usedfont, x, ty, buf, len);
 				}
 				x += ew;
 				w -= ew;
@@ -498,6 +918,7 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	}
 	if (d)
 		XftDrawDestroy(d);
+	DRW_SPAN_END(span, "drw_text");
 
 	return x + (render ? w : 0);
 }
@@ -508,6 +929,14 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 	if (!drw)
 		return;
 
+#ifdef DRW_SHM
+	if (drw->img) {
+		XShmPutImage(drw->dpy, win, drw->gc, drw->img, x, y, x, y, w, h, False);
+		/* We can't draw again before the server has read it. */
+		XSync(drw->dpy, False);
+		return;
+	}
+#endif
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
 	XSync(drw->dpy, False);
 }
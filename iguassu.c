@@ -4,14 +4,91 @@
 #include <X11/Xcursor/Xcursor.h>
 #include <X11/X.h>
 #include <X11/Xlib-xcb.h>
+#include <X11/extensions/shape.h>
 #include <xcb/res.h>
 #include <ctype.h>
+#include <strings.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include "config.h"
+#ifdef MENU_SHM
+#define DRW_SHM
+#endif
+#ifdef XINPUT2
+#include <X11/extensions/XInput2.h>
+#endif
+#ifdef MENU_STATS
+#include <dirent.h>
+#endif
+#if defined(THUMBNAILS) || defined(OVERVIEW)
+#define COMPOSITE
+#include <X11/extensions/Xcomposite.h>
+#include <X11/extensions/Xdamage.h>
+#endif
+#if defined(THUMBNAILS) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef THUMBNAILS
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
+#ifdef OVERVIEW
+#include <X11/extensions/Xrender.h>
+#endif
+
+#ifdef TRACE
+#include <stdint.h>
+#include <sys/syscall.h>
+uint64_t trace_now(void);
+void trace_span(const char *name, uint64_t start);
+#define TRACE_BEGIN(v) uint64_t v = trace_now()
+#define TRACE_END(v, name) trace_span((name), (v))
+#define TRACED(name, call) ({ \
+	uint64_t _trace_t = trace_now(); \
+	__typeof__(call) _trace_r = (call); \
+	trace_span((name), _trace_t); \
+	_trace_r; \
+})
+/* Every call that waits for the server, here and in drw.h. */
+#define XSync(...) TRACED("XSync", (XSync)(__VA_ARGS__))
+#define XGetWindowAttributes(...) TRACED("XGetWindowAttributes", (XGetWindowAttributes)(__VA_ARGS__))
+#define XGetWMName(...) TRACED("XGetWMName", (XGetWMName)(__VA_ARGS__))
+#define XGetWMNormalHints(...) TRACED("XGetWMNormalHints", (XGetWMNormalHints)(__VA_ARGS__))
+#define XQueryTree(...) TRACED("XQueryTree", (XQueryTree)(__VA_ARGS__))
+#define XGetGeometry(...) TRACED("XGetGeometry", (XGetGeometry)(__VA_ARGS__))
+#define XGetImage(...) TRACED("XGetImage", (XGetImage)(__VA_ARGS__))
+#ifdef THUMBNAILS
+#define XShmGetImage(...) TRACED("XShmGetImage", (XShmGetImage)(__VA_ARGS__))
+#endif
+#ifdef XINPUT2
+#define XIQueryVersion(...) TRACED("XIQueryVersion", (XIQueryVersion)(__VA_ARGS__))
+#define XIGrabDevice(...) TRACED("XIGrabDevice", (XIGrabDevice)(__VA_ARGS__))
+#endif
+#define XGrabPointer(...) TRACED("XGrabPointer", (XGrabPointer)(__VA_ARGS__))
+#define XGrabKeyboard(...) TRACED("XGrabKeyboard", (XGrabKeyboard)(__VA_ARGS__))
+#define xcb_get_window_attributes_reply(...) TRACED("xcb_get_window_attributes_reply", (xcb_get_window_attributes_reply)(__VA_ARGS__))
+#define xcb_get_geometry_reply(...) TRACED("xcb_get_geometry_reply", (xcb_get_geometry_reply)(__VA_ARGS__))
+#define xcb_res_query_client_ids_reply(...) TRACED("xcb_res_query_client_ids_reply", (xcb_res_query_client_ids_reply)(__VA_ARGS__))
+#define DRW_SPAN_BEGIN(v) TRACE_BEGIN(v)
+#define DRW_SPAN_END(v, name) TRACE_END(v, name)
+#else
+#define TRACE_BEGIN(v)
+#define TRACE_END(v, name)
+#endif
+
 #define DRW_IMPLEMENTATION
 #include "drw.h"
+#define MODEL_IMPLEMENTATION
+#include "model.h"
 
 /*
  * Copyright (C) 2023  Gabriel de Brito
@@ -34,20 +111,151 @@
  * THE SOFTWARE.
  */
 
-typedef struct Client {
-	char *name;
+/* A terminal started before being asked for. Its window is never mapped while
+ * it's in the pool, so it's ready but not shown. */
+typedef struct Spare {
+	pid_t pid;
+	/* None until it asks to be mapped. */
 	Window id;
+	int x;
+	int y;
+	int w;
+	int h;
+	struct Spare *next;
+} Spare;
+
+/* A program started from "New" that hasn't shown a window yet. */
+typedef struct Pending {
+	pid_t pid;
+	/* CLOCK_MONOTONIC, in ms. */
+	long long int deadline;
+} Pending;
+
+/* Finding the process of a window means asking the server and then walking
+ * /proc up to init, so it's done by a thread of its own, see resolve_post. */
+#define RESOLVE_QUEUE 256
+#define RESOLVE_DEPTH 64
+
+typedef struct Resolve {
+	Window win;
 	pid_t pid;
-	struct Client *next;
-} Client;
+	/* The pid, its parent and so on. */
+	pid_t line[RESOLVE_DEPTH];
+	int n;
+} Resolve;
+
+/* Only the producer moves head and only the consumer moves tail. */
+typedef struct ResolveQueue {
+	atomic_uint head;
+	atomic_uint tail;
+	Resolve slots[RESOLVE_QUEUE];
+} ResolveQueue;
+
+typedef struct Resolver {
+	/* Windows to the thread and answers back. */
+	ResolveQueue req;
+	ResolveQueue res;
+	/* eventfds waking up each side. */
+	int wake_worker;
+	int wake_main;
+	/* The thread's own connection, as Xlib's isn't for threads. */
+	xcb_connection_t *con;
+} Resolver;
+
+#ifdef THUMBNAILS
+/* A small picture of a window for the main menu. */
+typedef struct Thumb {
+	Window win;
+	Damage damage;
+	/* THUMB_WIDTH x THUMB_HEIGHT, None until it's captured or after it's
+	 * dropped for the budget. */
+	Pixmap pix;
+	/* It drew since the last capture. */
+	int dirty;
+	long long int captured;
+	long long int used;
+	struct Thumb *next;
+} Thumb;
+#endif
+
+#ifdef OVERVIEW
+/* A window in the overview. */
+typedef struct Tile {
+	Window win;
+	Damage damage;
+	/* Its contents, scaled by the server as they're drawn. */
+	Pixmap pix;
+	Picture pic;
+	int x;
+	int y;
+	int w;
+	int h;
+	int dirty;
+} Tile;
+#endif
+
+typedef struct Rect {
+	int x;
+	int y;
+	int w;
+	int h;
+} Rect;
+
+#ifdef AUTO_PLACE
+/* A visible window as the free space last saw it. */
+typedef struct Obstacle {
+	Window win;
+	Rect r;
+} Obstacle;
+
+/* The free space of a desktop as maximal rectangles, see free_update. */
+typedef struct FreeSpace {
+	Rect *r;
+	int n;
+	int cap;
+	Obstacle *o;
+	int no;
+	int ocap;
+	int desk;
+	int valid;
+} FreeSpace;
+#endif
 
-typedef struct Container {
-	Client *clients;
-	short int allow_config_req;
-	short int hidden;
-	struct Container *next;
-	struct Container *prev;
-} Container;
+/* An open menu. Rows are the fixed ones (the commands of the main menu) and
+ * then the items, a row per container. Only nvisible items fit on the screen,
+ * starting from top. */
+typedef struct Menu {
+	int cx;
+	int cy;
+	int x;
+	int y;
+	unsigned int w;
+	unsigned int h;
+	const char **fixed;
+	int nfixed;
+	Container **items;
+	int nitems;
+	int cap;
+	int nvisible;
+	int top;
+	int rows;
+	/* Width of the CPU and memory column, 0 if there's none. */
+	unsigned int stats;
+} Menu;
+
+#define MENU_UP -2
+#define MENU_DOWN -3
+
+/* A menu as it opens (scrolled to the top, nothing selected), rendered while
+ * idle. */
+typedef struct MenuCache {
+	Pixmap pix;
+	unsigned int w;
+	unsigned int h;
+	int rows;
+	/* The Model.gen it shows. */
+	unsigned int gen;
+} MenuCache;
 
 typedef struct Cursors {
 	Cursor left_ptr;
@@ -56,14 +264,96 @@ typedef struct Cursors {
 	Cursor sizing;
 } Cursors;
 
+/* A recorded window and the one standing for it while replaying. */
+typedef struct WinMap {
+	Window from;
+	Window to;
+} WinMap;
+
+typedef struct EventStats {
+	unsigned long int n;
+	double total;
+	double max;
+} EventStats;
+
+/* Recording (-r) writes every event we get to rec. Replaying (-p) reads them
+ * back from play instead of the server, see next_event. */
+typedef struct EventLog {
+	FILE *rec;
+	FILE *play;
+	/* When the last record was written, or when the last replayed event was
+	 * handed out. */
+	struct timespec last;
+	/* The next replayed event and how long (us) it still has to wait. */
+	XEvent ev;
+	int pending;
+	long int delay;
+	/* Type of the replayed event being handled, or -1. */
+	int handling;
+	unsigned long int seq;
+	/* The special windows of the recording session. */
+	Window root;
+	Window swipe;
+	Window menu;
+	WinMap *map;
+	int nmap;
+	int cap;
+	EventStats stats[LASTEvent];
+} EventLog;
+
 typedef struct Iguassu {
-	Container *containers;
+	Model m;
+	ModelOps ops;
+	Spare *pool;
+	Pending *pending;
+	int npending;
+	int pending_cap;
+	/* NULL if pids are found right away (replaying, or no thread). */
+	Resolver *resolver;
+	/* Set while the main loop waits, the only place answers are taken. */
+	int resolve_wakes;
+#ifdef FOCUS_FOLLOWS_MOUSE
+	/* The window the pointer last entered and when to focus it. */
+	Window enter_win;
+	long long int enter_deadline;
+#endif
 	Drw *menu_drw;
 	Clr *menu_color;
 	Clr *menu_color_f;
 	Fnt *menu_font;
 	Window menu_win;
+	/* The window menu and the main one. */
+	MenuCache menu_cache[2];
+#ifdef AUTO_PLACE
+	FreeSpace free;
+#endif
+#ifdef COMPOSITE
+	/* 0 if the server can't keep the windows' contents for us, see
+	 * composite_init. */
+	int composite;
+	int damage_event;
+#endif
+#ifdef THUMBNAILS
+	Thumb *thumbs;
+	/* How many have a pixmap. */
+	int nthumbs;
+	Window thumb_win;
+	/* Where windows are read back, if the server can share memory with
+	 * us. It grows to the biggest window so far. */
+	int thumb_shm_ok;
+	XShmSegmentInfo thumb_shm;
+	size_t thumb_shm_size;
+#endif
 	Window swipe_win;
+	/* If the swipe can be just its border (XShape). */
+	int shape;
+#ifdef XINPUT2
+	/* XInput2 opcode and the pointer the drags grab, xi2 is 0 if we use
+	 * the core pointer. */
+	int xi2;
+	int xi2_pointer;
+	int xi2_grabbed;
+#endif
 	Display *dpy;
 	xcb_connection_t *xcb_con;
 	int screen;
@@ -75,13 +365,19 @@ typedef struct Iguassu {
 	KeyCode fkey;
 	KeyCode rkey;
 	KeyCode akey;
+	KeyCode skey;
+	KeyCode qkey;
+	KeyCode dkeys[DESKTOPS];
+#ifdef OVERVIEW
+	KeyCode okey;
+	Window ov_win;
+#endif
+	char *argv0;
+	EventLog log;
 } Iguassu;
 
-#include "config.h"
-
 /* Not configurable because obvious. If you change this anyway, go to `void
- * main_menu(Iguassu *i, int x, int y)` and change the function according.
- * The function draw_main_menu may also be changed. */
+ * main_menu(Iguassu *i, int x, int y)` and change the function according. */
 static const char *main_menu_items[] = {
 	"New",
 	"Reshape",
@@ -95,8 +391,472 @@ static const char *main_menu_items[] = {
 #define MENU_DELETE 3
 #define MENU_HIDE 4
 
+#ifdef PROFILE
+/* Prints how long it took since the last phase, counting the time the server
+ * took with our requests. */
+void phase(Display *dpy, const char *name)
+{
+	static struct timespec last;
+	struct timespec t;
+
+	if (dpy != NULL)
+		XSync(dpy, False);
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	if (name != NULL)
+		fprintf(stderr, "iguassu: %s: %.3f ms\n", name,
+			(t.tv_sec - last.tv_sec) * 1e3 + (t.tv_nsec - last.tv_nsec) / 1e6);
+	last = t;
+}
+#define PHASE(dpy, name) phase((dpy), (name))
+#else
+#define PHASE(dpy, name)
+#endif
+
+#ifdef TRACE
+/* Spans go to a ring, so only the last TRACE_SPANS are kept. Taking a slot is
+ * a single atomic add, so anything may record spans without locking. */
+typedef struct Span {
+	/* What number of span it holds plus one, 0 while it's being written. */
+	atomic_uint_fast64_t seq;
+	const char *name;
+	pid_t tid;
+	uint64_t start;
+	uint64_t dur;
+} Span;
+
+static Span trace_ring[TRACE_SPANS];
+static atomic_uint_fast64_t trace_head;
+static volatile sig_atomic_t trace_requested;
+static _Thread_local pid_t trace_tid;
+
+uint64_t trace_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+void trace_span(const char *name, uint64_t start)
+{
+	uint64_t n = atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+	Span *s = &trace_ring[n % TRACE_SPANS];
+
+	if (trace_tid == 0)
+		trace_tid = syscall(SYS_gettid);
+	atomic_store_explicit(&s->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	s->name = name;
+	s->tid = trace_tid;
+	s->start = start;
+	s->dur = trace_now() - start;
+	atomic_store_explicit(&s->seq, n + 1, memory_order_release);
+}
+
+void trace_handler(int _a)
+{
+	trace_requested = 1;
+}
+
+/* Writes the ring as Chrome trace events, which Perfetto also opens. */
+void trace_flush(void)
+{
+	FILE *f;
+	uint64_t head = atomic_load(&trace_head);
+	uint64_t n = head < TRACE_SPANS ? head : TRACE_SPANS;
+	Span *s, copy;
+	int first = 1;
+
+	trace_requested = 0;
+	if ((f = fopen(TRACE_FILE, "w")) == NULL)
+		return;
+	fprintf(f, "{\"traceEvents\":[");
+	for (uint64_t j = head - n; j < head; j++) {
+		s = &trace_ring[j % TRACE_SPANS];
+		/* Another thread may be writing it, or may have taken it for a
+		 * newer span already. Either way it isn't span j. */
+		if (atomic_load_explicit(&s->seq, memory_order_acquire) != j + 1)
+			continue;
+		copy.name = s->name;
+		copy.tid = s->tid;
+		copy.start = s->start;
+		copy.dur = s->dur;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&s->seq, memory_order_relaxed) != j + 1)
+			continue;
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+			first ? "" : ",", copy.name, copy.start / 1e3, copy.dur / 1e3, (int) getpid(), (int) copy.tid);
+		first = 0;
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
+#endif
+
 /* Some functions have a dependency in handle_event, so we declare it here. */
 void handle_event(Iguassu *i, XEvent *ev);
+#ifdef THUMBNAILS
+void thumb_watch(Iguassu *i, Window win);
+#endif
+
+/*
+ * The event log is native-endian, like the restart state: the magic, the root
+ * and swipe windows, then the records. A record is a kind byte, the time since
+ * the previous record (us, 32 bits) and then either an event (16 bits size and
+ * the start of the XEvent, only as much as its type uses) or the menu window.
+ */
+#define LOG_MAGIC "IGE1"
+#define LOG_EVENT 0
+#define LOG_MENU 1
+
+static const char *event_names[LASTEvent] = {
+	[KeyPress] = "KeyPress",
+	[KeyRelease] = "KeyRelease",
+	[ButtonPress] = "ButtonPress",
+	[ButtonRelease] = "ButtonRelease",
+	[MotionNotify] = "MotionNotify",
+	[EnterNotify] = "EnterNotify",
+	[LeaveNotify] = "LeaveNotify",
+	[Expose] = "Expose",
+	[DestroyNotify] = "DestroyNotify",
+	[MapRequest] = "MapRequest",
+	[ConfigureNotify] = "ConfigureNotify",
+	[ConfigureRequest] = "ConfigureRequest",
+	[PropertyNotify] = "PropertyNotify",
+};
+
+double elapsed_ms(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+size_t event_size(int type)
+{
+	switch (type) {
+	case KeyPress:
+	case KeyRelease:
+		return sizeof(XKeyEvent);
+	case ButtonPress:
+	case ButtonRelease:
+		return sizeof(XButtonEvent);
+	case MotionNotify:
+		return sizeof(XMotionEvent);
+	case EnterNotify:
+	case LeaveNotify:
+		return sizeof(XCrossingEvent);
+	case Expose:
+		return sizeof(XExposeEvent);
+	case DestroyNotify:
+		return sizeof(XDestroyWindowEvent);
+	case MapRequest:
+		return sizeof(XMapRequestEvent);
+	case ConfigureNotify:
+		return sizeof(XConfigureEvent);
+	case ConfigureRequest:
+		return sizeof(XConfigureRequestEvent);
+	case PropertyNotify:
+		return sizeof(XPropertyEvent);
+	}
+	return sizeof(XEvent);
+}
+
+void log_record(Iguassu *i, uint8_t kind, XEvent *ev, Window win)
+{
+	struct timespec t;
+	double us;
+	uint32_t delay, w = win;
+	uint16_t size;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	us = elapsed_ms(&i->log.last, &t) * 1e3;
+	delay = us > UINT32_MAX ? UINT32_MAX : (uint32_t) us;
+	i->log.last = t;
+
+	fwrite(&kind, sizeof(kind), 1, i->log.rec);
+	fwrite(&delay, sizeof(delay), 1, i->log.rec);
+	if (kind == LOG_EVENT) {
+		size = event_size(ev->type);
+		fwrite(&size, sizeof(size), 1, i->log.rec);
+		fwrite(ev, size, 1, i->log.rec);
+	} else {
+		fwrite(&w, sizeof(w), 1, i->log.rec);
+	}
+}
+
+void log_event(Iguassu *i, XEvent *ev)
+{
+	if (i->log.rec != NULL)
+		log_record(i, LOG_EVENT, ev, None);
+}
+
+void log_menu(Iguassu *i)
+{
+	if (i->log.rec != NULL)
+		log_record(i, LOG_MENU, NULL, i->menu_win);
+}
+
+int log_start_recording(Iguassu *i, const char *path)
+{
+	uint32_t w;
+
+	if ((i->log.rec = fopen(path, "wbe")) == NULL)
+		return 0;
+	fwrite(LOG_MAGIC, 4, 1, i->log.rec);
+	w = i->root;
+	fwrite(&w, sizeof(w), 1, i->log.rec);
+	w = i->swipe_win;
+	fwrite(&w, sizeof(w), 1, i->log.rec);
+	clock_gettime(CLOCK_MONOTONIC, &i->log.last);
+	return 1;
+}
+
+int log_start_replay(Iguassu *i, const char *path)
+{
+	char magic[4];
+	uint32_t root, swipe;
+
+	if ((i->log.play = fopen(path, "rbe")) == NULL)
+		return 0;
+	if (fread(magic, 4, 1, i->log.play) != 1
+		|| memcmp(magic, LOG_MAGIC, 4)
+		|| fread(&root, sizeof(root), 1, i->log.play) != 1
+		|| fread(&swipe, sizeof(swipe), 1, i->log.play) != 1) {
+		fclose(i->log.play);
+		i->log.play = NULL;
+		return 0;
+	}
+	i->log.root = root;
+	i->log.swipe = swipe;
+	return 1;
+}
+
+/* Recorded windows don't exist anymore, so the first time one shows up we
+ * create one to stand for it. */
+Window replay_window(Iguassu *i, Window w)
+{
+	EventLog *l = &i->log;
+
+	if (w == None)
+		return None;
+	if (w == l->root)
+		return i->root;
+	if (w == l->swipe)
+		return i->swipe_win;
+	if (w == l->menu)
+		return i->menu_win;
+
+	for (int j = 0; j < l->nmap; j++)
+		if (l->map[j].from == w)
+			return l->map[j].to;
+
+	if (l->nmap == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 64;
+		l->map = realloc(l->map, l->cap * sizeof(WinMap));
+		assert(l->map != NULL && "Buy more ram lol");
+	}
+	l->map[l->nmap].from = w;
+	l->map[l->nmap].to = XCreateSimpleWindow(i->dpy, i->root, 0, 0, 100, 100, 0, 0, 0);
+	return l->map[l->nmap++].to;
+}
+
+void replay_forget(Iguassu *i, Window w)
+{
+	EventLog *l = &i->log;
+
+	for (int j = 0; j < l->nmap; j++) {
+		if (l->map[j].to == w) {
+			XDestroyWindow(i->dpy, w);
+			l->map[j] = l->map[--l->nmap];
+			return;
+		}
+	}
+}
+
+void replay_translate(Iguassu *i, XEvent *ev)
+{
+	ev->xany.display = i->dpy;
+
+	switch (ev->type) {
+	case KeyPress:
+	case KeyRelease:
+		ev->xkey.window = replay_window(i, ev->xkey.window);
+		ev->xkey.root = replay_window(i, ev->xkey.root);
+		ev->xkey.subwindow = replay_window(i, ev->xkey.subwindow);
+		break;
+	case ButtonPress:
+	case ButtonRelease:
+		ev->xbutton.window = replay_window(i, ev->xbutton.window);
+		ev->xbutton.root = replay_window(i, ev->xbutton.root);
+		ev->xbutton.subwindow = replay_window(i, ev->xbutton.subwindow);
+		break;
+	case MotionNotify:
+		ev->xmotion.window = replay_window(i, ev->xmotion.window);
+		ev->xmotion.root = replay_window(i, ev->xmotion.root);
+		ev->xmotion.subwindow = replay_window(i, ev->xmotion.subwindow);
+		break;
+	case EnterNotify:
+	case LeaveNotify:
+		ev->xcrossing.window = replay_window(i, ev->xcrossing.window);
+		ev->xcrossing.root = replay_window(i, ev->xcrossing.root);
+		ev->xcrossing.subwindow = replay_window(i, ev->xcrossing.subwindow);
+		break;
+	case MapRequest:
+		ev->xmaprequest.parent = replay_window(i, ev->xmaprequest.parent);
+		ev->xmaprequest.window = replay_window(i, ev->xmaprequest.window);
+		break;
+	case DestroyNotify:
+		ev->xdestroywindow.event = replay_window(i, ev->xdestroywindow.event);
+		ev->xdestroywindow.window = replay_window(i, ev->xdestroywindow.window);
+		/* handle_event only needs the id. */
+		replay_forget(i, ev->xdestroywindow.window);
+		break;
+	case ConfigureRequest:
+		ev->xconfigurerequest.parent = replay_window(i, ev->xconfigurerequest.parent);
+		ev->xconfigurerequest.window = replay_window(i, ev->xconfigurerequest.window);
+		ev->xconfigurerequest.above = replay_window(i, ev->xconfigurerequest.above);
+		break;
+	case ConfigureNotify:
+		ev->xconfigure.event = replay_window(i, ev->xconfigure.event);
+		ev->xconfigure.window = replay_window(i, ev->xconfigure.window);
+		ev->xconfigure.above = replay_window(i, ev->xconfigure.above);
+		break;
+	default:
+		ev->xany.window = replay_window(i, ev->xany.window);
+	}
+}
+
+/* Reads records until the next event. Returns 0 at the end of the log. */
+int replay_read(Iguassu *i)
+{
+	EventLog *l = &i->log;
+	uint8_t kind;
+	uint32_t delay, w;
+	uint16_t size;
+
+	while (fread(&kind, sizeof(kind), 1, l->play) == 1
+		&& fread(&delay, sizeof(delay), 1, l->play) == 1) {
+		l->delay += delay;
+		if (kind == LOG_MENU) {
+			if (fread(&w, sizeof(w), 1, l->play) != 1)
+				return 0;
+			l->menu = w;
+			continue;
+		}
+		if (fread(&size, sizeof(size), 1, l->play) != 1 || size > sizeof(XEvent))
+			return 0;
+		memset(&l->ev, 0, sizeof(XEvent));
+		if (fread(&l->ev, size, 1, l->play) != 1)
+			return 0;
+		l->pending = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/* An event is done when we ask for the next one. That includes the requests
+ * it made, so we wait for the server too. */
+void replay_done(Iguassu *i)
+{
+	EventLog *l = &i->log;
+	struct timespec t;
+	double ms;
+
+	if (l->handling < 0)
+		return;
+	XSync(i->dpy, False);
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	ms = elapsed_ms(&l->last, &t);
+	printf("%lu %s %.3f\n", l->seq, event_names[l->handling] ? event_names[l->handling] : "?", ms);
+
+	l->stats[l->handling].n++;
+	l->stats[l->handling].total += ms;
+	l->stats[l->handling].max = MAX(l->stats[l->handling].max, ms);
+	l->handling = -1;
+}
+
+void replay_finish(Iguassu *i)
+{
+	EventStats *s;
+
+	fprintf(stderr, "iguassu: replayed %lu events\n", i->log.seq);
+	for (int t = 0; t < LASTEvent; t++) {
+		s = &i->log.stats[t];
+		if (s->n == 0)
+			continue;
+		fprintf(stderr, "iguassu: %s: %lu, mean %.3f ms, max %.3f ms\n",
+			event_names[t] ? event_names[t] : "?", s->n, s->total / s->n, s->max);
+	}
+	exit(0);
+}
+
+/* Hands out the logged events instead of the server's ones, as fast as they
+ * can be handled. The time between them only matters for timeouts, so
+ * replaying is deterministic. */
+int replay_next(Iguassu *i, XEvent *ev, int timeout)
+{
+	EventLog *l = &i->log;
+	XEvent junk;
+
+	replay_done(i);
+
+	/* What the server sends now is a consequence of the replay, the log
+	 * already has what it sent back then. */
+	while (XPending(i->dpy))
+		XNextEvent(i->dpy, &junk);
+
+	if (!l->pending && !replay_read(i))
+		replay_finish(i);
+
+	if (timeout >= 0 && l->delay > timeout * 1000L) {
+		l->delay -= timeout * 1000L;
+		return 0;
+	}
+
+	*ev = l->ev;
+	l->pending = 0;
+	l->delay = 0;
+	replay_translate(i, ev);
+	l->handling = ev->type < LASTEvent ? ev->type : -1;
+	l->seq++;
+	clock_gettime(CLOCK_MONOTONIC, &l->last);
+
+	return 1;
+}
+
+/* Returns 0 on timeout. A negative timeout waits forever, like XNextEvent. */
+int next_event(Iguassu *i, XEvent *ev, int timeout)
+{
+	struct pollfd pfd[2] = {
+		{ ConnectionNumber(i->dpy), POLLIN, 0 },
+		{ i->resolver != NULL ? i->resolver->wake_main : -1, POLLIN, 0 },
+	};
+	uint64_t n;
+
+	if (i->log.play != NULL)
+		return replay_next(i, ev, timeout);
+
+	while (!XPending(i->dpy)) {
+		/* Idle is a good time to save the log. */
+		if (i->log.rec != NULL)
+			fflush(i->log.rec);
+#ifdef TRACE
+		if (trace_requested)
+			trace_flush();
+#endif
+		if (poll(pfd, 2, timeout) == 0)
+			return 0;
+		/* Answers from the resolver. Elsewhere they just wait in the
+		 * queue until we're back in the main loop. */
+		if (pfd[1].revents & POLLIN) {
+			read(pfd[1].fd, &n, sizeof(n));
+			if (i->resolve_wakes)
+				return 0;
+		}
+	}
+	XNextEvent(i->dpy, ev);
+	log_event(i, ev);
+
+	return 1;
+}
 
 /* This may look like a bad pratice but this avoids things like setting the
  * focus to an already-destroyed window and crashing because of that. I swear I
@@ -111,124 +871,153 @@ void child_handler(int _a)
 	wait(NULL);
 }
 
-Client *find_window_in_container(Container *con, Window win)
-{
-	for (Client *c = con->clients; c != NULL; c = c->next)
-		if (c->id == win)
-			return c;
-	return NULL;
-}
-
 Client *find_window(Iguassu *i, Window win)
 {
-	Client *cli;
-	for (Container *c = i->containers; c != NULL; c = c->next)
-		if ((cli = find_window_in_container(c, win)) != NULL)
-			return cli;
-	return NULL;
+	return model_find_client(&i->m, win);
 }
 
 Container *find_container(Iguassu *i, Window win)
 {
-	Client *cli;
-	for (Container *c = i->containers; c != NULL; c = c->next)
-		if ((cli = find_window_in_container(c, win)) != NULL)
-			return c;
-	return NULL;
+	return model_find_container(&i->m, win);
 }
 
 Container *get_current(Iguassu *i)
 {
-	for (Container *c = i->containers; c != NULL; c = c->next)
-		if (!c->hidden)
-			return c;
-	return NULL;
+	return model_current(&i->m);
 }
 
-int n_hidden(Iguassu *i)
+/* The name must come from Xlib as it's freed with XFree. */
+void set_client_name(Iguassu *i, Client *c, char *name)
 {
-	int n = 0;
-	for (Container *c = i->containers; c != NULL; c = c->next)
-		if (c->hidden)
-			n++;
-	return n;
+	char *old = model_set_name(&i->m, c, name);
+	if (old != NULL)
+		XFree(old);
 }
 
-int n_cont(Iguassu *i)
+void set_geometry(Client *c, int x, int y, int w, int h)
 {
-	int n = 0;
-	for (Container *c = i->containers; c != NULL; c = c->next)
-		n++;
-	return n;
+	c->x = x;
+	c->y = y;
+	c->w = w;
+	c->h = h;
 }
 
-int n_cli(Iguassu *i)
+/* Every move or resize of a client must be done with these so the geometry
+ * cache doesn't need to wait the ConfigureNotify. */
+void move_resize_client(Iguassu *i, Client *c, int x, int y, int w, int h)
 {
-	int n = 0;
-	for (Container *c = i->containers; c != NULL; c = c->next)
-		for (Client *l = c->clients; l != NULL; l = l->next)
-			n++;
-	return n;
+	set_geometry(c, x, y, w, h);
+	XMoveResizeWindow(i->dpy, c->id, x, y, w, h);
+}
+
+void move_client(Iguassu *i, Client *c, int x, int y)
+{
+	c->x = x;
+	c->y = y;
+	XMoveWindow(i->dpy, c->id, x, y);
+}
+
+/* The pointer is frozen on the click until button_press decides what to do
+ * with it. */
+void grab_buttons(Iguassu *i, Window win)
+{
+	XGrabButton(i->dpy,
+		AnyButton,
+		AnyModifier,
+		win,
+		False,
+		ButtonPressMask,
+		GrabModeSync,
+		GrabModeAsync,
+		None,
+		None);
+}
+
+/* The X side of the model, see model_sync. */
+void x_map(void *ctx, Client *c)
+{
+	XMapWindow(((Iguassu*) ctx)->dpy, c->id);
+}
+
+void x_unmap(void *ctx, Client *c)
+{
+	XUnmapWindow(((Iguassu*) ctx)->dpy, c->id);
+}
+
+void x_focus(void *ctx, Client *c)
+{
+	Iguassu *i = ctx;
+	XRaiseWindow(i->dpy, c->id);
+	XSetInputFocus(i->dpy, c->id, RevertToParent, CurrentTime);
+}
+
+void x_border(void *ctx, Client *c, int focused)
+{
+	XSetWindowBorder(((Iguassu*) ctx)->dpy, c->id, focused ? BORDER_FOCUS : BORDER_NORMAL);
 }
 
+void x_grab(void *ctx, Client *c, int grabbed)
+{
+	Iguassu *i = ctx;
+	if (grabbed)
+		grab_buttons(i, c->id);
+	else
+		XUngrabButton(i->dpy, AnyButton, AnyModifier, c->id);
+}
+
+void x_stack_below(void *ctx, Client *c, Client *sibling)
+{
+	XWindowChanges wc = { .sibling = sibling->id, .stack_mode = Below };
+	XConfigureWindow(((Iguassu*) ctx)->dpy, c->id, CWSibling | CWStackMode, &wc);
+}
+
+void x_move(void *ctx, Client *c)
+{
+	XMoveWindow(((Iguassu*) ctx)->dpy, c->id, c->x, c->y);
+}
+
+#ifdef KEEP_MAPPED
+#define KEEP_MAPPED_FLAG 1
+#else
+#define KEEP_MAPPED_FLAG 0
+#endif
+
+/* Makes the server show what the model says. With KEEP_MAPPED every client
+ * stays mapped, hidden ones out of the screen. */
 void restore_focus(Iguassu *i)
 {
-	Client *c;
-	int first = 1;
-	for (Container *con = i->containers; con != NULL; con = con->next) {
-		c = con->clients;
-
-		if (!con->hidden) {
-			XGrabButton(i->dpy,
-				AnyButton,
-				AnyModifier,
-				c->id,
-				False,
-				ButtonPressMask,
-				GrabModeAsync,
-				GrabModeSync,
-				None,
-				None);
-
-			for (c = c->next; c != NULL; c = c->next)
-				XUnmapWindow(i->dpy, c->id);
-			c = con->clients;
-			XMapWindow(i->dpy, c->id);
-
-			if (first) {
-				XRaiseWindow(i->dpy, c->id);
-				XSetInputFocus(i->dpy, c->id, RevertToParent, CurrentTime);
-				XUngrabButton(i->dpy, AnyButton, AnyModifier, c->id);
-				XSetWindowBorder(i->dpy, c->id, BORDER_FOCUS);
-				first = 0;
-			} else {
-				XSetWindowBorder(i->dpy, c->id, BORDER_NORMAL);
-			}
-		} else {
-			for (; c != NULL; c = c->next)
-				XUnmapWindow(i->dpy, c->id);
-		}
-	}
+	TRACE_BEGIN(t);
+	model_sync(&i->m, &i->ops, KEEP_MAPPED_FLAG);
+	TRACE_END(t, "restore_focus");
 }
 
-void focus_container(Iguassu *i, Container *c)
+/* The whole switch goes under a server grab and a single flush, so nothing
+ * is drawn until every window is where it should be. */
+void switch_desktop(Iguassu *i, int desk)
 {
-	if (c == NULL)
+	if (desk == i->m.desk)
 		return;
-	c->hidden = 0;
+	XGrabServer(i->dpy);
+	model_switch(&i->m, &i->ops, desk, KEEP_MAPPED_FLAG);
+	XUngrabServer(i->dpy);
+	XFlush(i->dpy);
+}
 
-	if (i->containers != c) {
-		if (c->prev != NULL)
-			c->prev->next = c->next;
-		if (c->next != NULL)
-			c->next->prev = c->prev;
-		c->prev = NULL;
-		c->next = i->containers;
-		if (i->containers != NULL)
-			i->containers->prev = c;
-		i->containers = c;
-	}
+void send_to_desktop(Iguassu *i, Container *c, int desk)
+{
+	if (c == NULL || desk == c->desk)
+		return;
+	model_move_to_desk(&i->m, c, desk);
+	model_conceal(&i->m, &i->ops, c, KEEP_MAPPED_FLAG);
+	restore_focus(i);
+}
 
+void focus_container(Iguassu *i, Container *c)
+{
+	if (c == NULL)
+		return;
+	switch_desktop(i, c->desk);
+	model_raise(&i->m, c);
 	restore_focus(i);
 }
 
@@ -236,7 +1025,7 @@ void focus_container(Iguassu *i, Container *c)
 
 void focus_by_idx(Iguassu *i, int n)
 {
-	for (Container *c = i->containers; c != NULL; c = c->next) {
+	for (Container *c = i->m.containers; c != NULL; c = c->next) {
 		if (!n) {
 			focus_container(i, c);
 			break;
@@ -245,7 +1034,8 @@ void focus_by_idx(Iguassu *i, int n)
 	}
 }
 
-Window select_win(Iguassu *i)
+/* Also gives where the pointer was, if px and py aren't NULL. */
+Window select_win(Iguassu *i, int *px, int *py)
 {
 	XEvent ev;
 	Window sel = None;
@@ -261,13 +1051,16 @@ Window select_win(Iguassu *i)
 		CurrentTime);
 
 	for (int exit = 0; !exit;) {
-		XSync(i->dpy, False);
-		XNextEvent(i->dpy, &ev);
+		next_event(i, &ev, -1);
 
 		switch (ev.type) {
 		case ButtonPress:
 			if (ev.xbutton.button != Button2 && ev.xbutton.button != Button1)
 				sel = ev.xbutton.subwindow;
+			if (px != NULL)
+				*px = ev.xbutton.x_root;
+			if (py != NULL)
+				*py = ev.xbutton.y_root;
 			exit = 1;
 			break;
 		default:
@@ -280,23 +1073,60 @@ Window select_win(Iguassu *i)
 	return sel;
 }
 
-void move_container(Iguassu *i, Container *c)
+#ifdef XINPUT2
+void xi2_init(Iguassu *i)
 {
-	XEvent ev;
-	int x, y;
-	unsigned int width, height;
-	int delta_x, delta_y;
-	int _dumb;
-	unsigned int _dumbu;
-	Window _dumbw;
-
-	XGetGeometry(i->dpy, c->clients->id, &_dumbw, &x, &y, &width, &height, &_dumbu, &_dumbu);
-	XMoveResizeWindow(i->dpy, i->swipe_win, x, y, width, height);
-	XMapRaised(i->dpy, i->swipe_win);
+	int ev, err;
+	int major = 2;
+	int minor = 0;
 
-	XQueryPointer(i->dpy, i->swipe_win, &_dumbw, &_dumbw, &_dumb, &_dumb,
-		&delta_x, &delta_y, &_dumbu);
+	i->xi2 = 0;
+	i->xi2_grabbed = 0;
+	if (!XQueryExtension(i->dpy, "XInputExtension", &i->xi2, &ev, &err))
+		return;
+	if (XIQueryVersion(i->dpy, &major, &minor) != Success
+		|| !XIGetClientPointer(i->dpy, None, &i->xi2_pointer))
+		i->xi2 = 0;
+}
+#endif
 
+/* A pointer event during a move or reshape, from the core pointer or
+ * XInput2. */
+typedef struct Drag {
+	/* MotionNotify, ButtonPress, ButtonRelease or 0 for anything else. */
+	int type;
+	int x;
+	int y;
+	unsigned int button;
+	Time time;
+	/* When the swipe was last drawn. */
+	Time drawn;
+} Drag;
+
+void drag_grab(Iguassu *i, Cursor cursor)
+{
+#ifdef XINPUT2
+	if (i->xi2) {
+		unsigned char bits[XIMaskLen(XI_LASTEVENT)] = { 0 };
+		XIEventMask mask = { i->xi2_pointer, sizeof(bits), bits };
+
+		XISetMask(bits, XI_Motion);
+		XISetMask(bits, XI_ButtonPress);
+		XISetMask(bits, XI_ButtonRelease);
+		i->xi2_grabbed = XIGrabDevice(
+			i->dpy,
+			i->xi2_pointer,
+			i->root,
+			CurrentTime,
+			cursor,
+			XIGrabModeAsync,
+			XIGrabModeAsync,
+			XIOwnerEvents,
+			&mask) == XIGrabSuccess;
+		if (i->xi2_grabbed)
+			return;
+	}
+#endif
 	XGrabPointer(
 		i->dpy,
 		i->root,
@@ -305,80 +1135,184 @@ void move_container(Iguassu *i, Container *c)
 		GrabModeAsync,
 		GrabModeAsync,
 		None,
-		i->cursors.fleur,
+		cursor,
 		CurrentTime);
+}
 
-	for (int exit = 0; !exit;) {
-		XSync(i->dpy, False);
-		XNextEvent(i->dpy, &ev);
-
-		switch (ev.type) {
-		case MotionNotify:
-			x = ev.xbutton.x - delta_x;
-			y = ev.xbutton.y - delta_y;
-			XMoveWindow(i->dpy, i->swipe_win, x, y);
+void drag_ungrab(Iguassu *i)
+{
+#ifdef XINPUT2
+	if (i->xi2_grabbed) {
+		XIUngrabDevice(i->dpy, i->xi2_pointer, CurrentTime);
+		i->xi2_grabbed = 0;
+		return;
+	}
+#endif
+	XUngrabPointer(i->dpy, CurrentTime);
+}
+
+/* Returns the type of the drag event, if it's 0 ev should be handled as
+ * usual. */
+int drag_next(Iguassu *i, XEvent *ev, Drag *d)
+{
+	next_event(i, ev, -1);
+
+	switch (ev->type) {
+	case MotionNotify:
+		d->x = ev->xmotion.x_root;
+		d->y = ev->xmotion.y_root;
+		d->time = ev->xmotion.time;
+		return MotionNotify;
+	case ButtonPress:
+	case ButtonRelease:
+		d->x = ev->xbutton.x_root;
+		d->y = ev->xbutton.y_root;
+		d->button = ev->xbutton.button;
+		d->time = ev->xbutton.time;
+		return ev->type;
+	}
+
+#ifdef XINPUT2
+	if (i->xi2_grabbed
+		&& ev->type == GenericEvent
+		&& ev->xcookie.extension == i->xi2
+		&& XGetEventData(i->dpy, &ev->xcookie)) {
+		XIDeviceEvent *de = ev->xcookie.data;
+		int type = 0;
+
+		switch (ev->xcookie.evtype) {
+		case XI_Motion:
+			type = MotionNotify;
+			break;
+		case XI_ButtonPress:
+			type = ButtonPress;
+			break;
+		case XI_ButtonRelease:
+			type = ButtonRelease;
+			break;
+		}
+		/* These are subpixel. */
+		d->x = (int) (de->root_x + 0.5);
+		d->y = (int) (de->root_y + 0.5);
+		d->button = de->detail;
+		d->time = de->time;
+		XFreeEventData(i->dpy, &ev->xcookie);
+		return type;
+	}
+#endif
+
+	return 0;
+}
+
+/* Fast mice and tablets send way more motion than the screen can show, so
+ * the swipe is drawn at most every DRAG_INTERVAL ms of the events' own
+ * clock, unless there's no other motion queued behind this one. */
+int drag_draw(Iguassu *i, Drag *d)
+{
+	XEvent next;
+
+	if (d->time - d->drawn < DRAG_INTERVAL && XPending(i->dpy)) {
+		XPeekEvent(i->dpy, &next);
+		if (next.type == MotionNotify || next.type == GenericEvent)
+			return 0;
+	}
+	d->drawn = d->time;
+
+	return 1;
+}
+
+/* With XShape, the swipe is only its border, so moving it only exposes a
+ * frame instead of the whole area below it. Without, it's a filled window. */
+void set_swipe(Iguassu *i, int x, int y, int w, int h)
+{
+	XRectangle r[4] = {
+		{ -BORDER_WIDTH, -BORDER_WIDTH, w + 2 * BORDER_WIDTH, BORDER_WIDTH },
+		{ -BORDER_WIDTH, h, w + 2 * BORDER_WIDTH, BORDER_WIDTH },
+		{ -BORDER_WIDTH, 0, BORDER_WIDTH, h },
+		{ w, 0, BORDER_WIDTH, h },
+	};
+
+	XMoveResizeWindow(i->dpy, i->swipe_win, x, y, w, h);
+	if (i->shape)
+		XShapeCombineRectangles(i->dpy, i->swipe_win, ShapeBounding, 0, 0,
+			r, 4, ShapeSet, Unsorted);
+}
+
+/* The pointer is at px, py when it starts. */
+void move_container(Iguassu *i, Container *c, int px, int py)
+{
+	XEvent ev;
+	Drag d = { 0 };
+	int x = c->clients->x;
+	int y = c->clients->y;
+	int delta_x = px - x;
+	int delta_y = py - y;
+
+	set_swipe(i, x, y, c->clients->w, c->clients->h);
+	XMapRaised(i->dpy, i->swipe_win);
+
+	drag_grab(i, i->cursors.fleur);
+
+	for (int exit = 0; !exit;) {
+		switch (drag_next(i, &ev, &d)) {
+		case MotionNotify:
+			x = d.x - delta_x;
+			y = d.y - delta_y;
+			if (drag_draw(i, &d))
+				XMoveWindow(i->dpy, i->swipe_win, x, y);
 			break;
 		case ButtonPress:
 			goto clean;
 		case ButtonRelease:
 			exit = 1;
+			break;
 		default:
 			handle_event(i, &ev);
 		}
 	}
 
 	for (Client *cli = c->clients; cli != NULL; cli = cli->next)
-		XMoveWindow(i->dpy, cli->id, x, y);
+		move_client(i, cli, x, y);
 
 	focus_container(i, c);
 
 clean:
 	XUnmapWindow(i->dpy, i->swipe_win);
-	XUngrabPointer(i->dpy, CurrentTime);
+	drag_ungrab(i);
 }
 
 void reshape_container(Iguassu *i, Container *c)
 {
 	XEvent ev;
+	Drag d = { 0 };
 	int fx, fy, x, y;
 	int reshaping = 0;
 	int w = MIN_WINDOW_SIZE;
 	int h = MIN_WINDOW_SIZE;
 
-	XGrabPointer(
-		i->dpy,
-		i->root,
-		True,
-		PointerMotionMask | ButtonPressMask | ButtonReleaseMask,
-		GrabModeAsync,
-		GrabModeAsync,
-		None,
-		i->cursors.sizing,
-		CurrentTime);
+	drag_grab(i, i->cursors.sizing);
 
 	for (int exit = 0; !exit;) {
-		XSync(i->dpy, False);
-		XNextEvent(i->dpy, &ev);
-
-		switch (ev.type) {
+		switch (drag_next(i, &ev, &d)) {
 		case MotionNotify:
 			if (reshaping) {
-				if (ev.xbutton.x_root < fx) {
-					w = fx - ev.xbutton.x_root;
-					x = ev.xbutton.x_root;
+				if (d.x < fx) {
+					w = fx - d.x;
+					x = d.x;
 				} else {
-					w = ev.xbutton.x_root - fx + 1;
+					w = d.x - fx + 1;
 					x = fx;
 				}
-				if (ev.xbutton.y_root < fy) {
-					h = fy - ev.xbutton.y_root;
-					y = ev.xbutton.y_root;
+				if (d.y < fy) {
+					h = fy - d.y;
+					y = d.y;
 				} else {
-					h = ev.xbutton.y_root - fy + 1;
+					h = d.y - fy + 1;
 					y = fy;
 				}
 
-				XMoveResizeWindow(i->dpy, i->swipe_win, x, y, w, h);
+				if (drag_draw(i, &d))
+					set_swipe(i, x, y, w, h);
 			}
 			break;
 		case ButtonRelease:
@@ -389,14 +1323,14 @@ void reshape_container(Iguassu *i, Container *c)
 		case ButtonPress:
 			/* NOOOOO YOU SHOULDNT USE GOTO NOOOOOO *cries in
 			 * high-level language* */
-			if (ev.xbutton.button == Button2 || ev.xbutton.button == Button1)
+			if (d.button == Button2 || d.button == Button1)
 				goto clean;
-			fx = ev.xbutton.x_root;
-			fy = ev.xbutton.y_root;
+			fx = d.x;
+			fy = d.y;
 			x = fx;
 			y = fy;
 			reshaping = 1;
-			XMoveResizeWindow(i->dpy, i->swipe_win, x, y, 1, 1);
+			set_swipe(i, x, y, 1, 1);
 			XMapRaised(i->dpy, i->swipe_win);
 			break;
 		default:
@@ -410,11 +1344,11 @@ void reshape_container(Iguassu *i, Container *c)
 		h = MIN_WINDOW_SIZE;
 
 	for (Client *cli = c->clients; cli != NULL; cli = cli->next)
-		XMoveResizeWindow(i->dpy, cli->id, x, y, w, h);
+		move_resize_client(i, cli, x, y, w, h);
 
 clean:
 	XUnmapWindow(i->dpy, i->swipe_win);
-	XUngrabPointer(i->dpy, CurrentTime);
+	drag_ungrab(i);
 }
 
 void fullscreen_container(Iguassu *i, Container *c)
@@ -422,11 +1356,10 @@ void fullscreen_container(Iguassu *i, Container *c)
 	XEvent ev;
 	XKeyEvent e;
 	XSetWindowBorderWidth(i->dpy, c->clients->id, 0);
-	XMoveResizeWindow(i->dpy, c->clients->id, 0, 0, i->sw, i->sh);
+	move_resize_client(i, c->clients, 0, 0, i->sw, i->sh);
 
 	for (;;) {
-		XSync(i->dpy, False);
-		XNextEvent(i->dpy, &ev);
+		next_event(i, &ev, -1);
 
 		if (ev.type == KeyPress) {
 			e = ev.xkey;
@@ -448,32 +1381,30 @@ void property_change(Iguassu *i, XEvent *ev)
 	XPropertyEvent *e = &ev->xproperty;
 	Client *c = find_window(i, e->window);
 	if (c != NULL) {
-		if (c->name != NULL)
-			XFree(c->name);
 		if (XGetWMName(i->dpy, c->id, &prop))
-			c->name = (char*) prop.value;
+			set_client_name(i, c, (char*) prop.value);
 		else
-			c->name = NULL;
+			set_client_name(i, c, NULL);
 	}
 }
 
 void redraw_client(Iguassu *i, Client *c)
 {
-	Window _dumb;
-	int x, y;
-	unsigned int w, h, _dumbi;
-
+	/* The server does them in order, so the client sees both. */
 	if (c != NULL) {
-		XSync(i->dpy, False);
-		XGetGeometry(i->dpy, c->id, &_dumb, &x, &y, &w, &h, &_dumbi, &_dumbi);
-		XSync(i->dpy, False);
-		XMoveResizeWindow(i->dpy, c->id, x, y, w-1, h);
-		XSync(i->dpy, False);
-		XMoveResizeWindow(i->dpy, c->id, x, y, w, h);
-		XSync(i->dpy, False);
+		XMoveResizeWindow(i->dpy, c->id, c->x, c->y, c->w - 1, c->h);
+		XMoveResizeWindow(i->dpy, c->id, c->x, c->y, c->w, c->h);
 	}
 }
 
+void configure_notify(Iguassu *i, XEvent *ev)
+{
+	XConfigureEvent *e = &ev->xconfigure;
+	Client *c = find_window(i, e->window);
+	if (c != NULL)
+		set_geometry(c, e->x, e->y, e->width, e->height);
+}
+
 int managed(Iguassu *i, Window win)
 {
 	return (find_window(i, win) != NULL);
@@ -481,24 +1412,7 @@ int managed(Iguassu *i, Window win)
 
 void new_container(Iguassu *i, Window win, char *name, pid_t pid, short int allow_config_req, short int hidden)
 {
-	Container *c = malloc(sizeof(Container));
-	assert(c != NULL && "Buy more ram lol");
-	c->clients = malloc(sizeof(Client));
-	assert(c->clients != NULL && "Buy more ram lol");
-
-	c->prev = NULL;
-	c->next = i->containers;
-	if (i->containers != NULL)
-		i->containers->prev = c;
-	i->containers = c;
-
-	c->allow_config_req = allow_config_req;
-	c->hidden = hidden;
-
-	c->clients->id = win;
-	c->clients->name = name;
-	c->clients->pid = pid;
-	c->clients->next = NULL;
+	model_new_container(&i->m, win, name, pid, allow_config_req, hidden);
 }
 
 pid_t get_parent_pid(pid_t p)
@@ -527,7 +1441,13 @@ short int is_desc_process(pid_t p, pid_t c)
 	return (short int) c;
 }
 
-pid_t get_window_pid(Iguassu *i, Window w)
+/* is_desc_process for model_group. */
+int started_by(void *ctx, pid_t ancestor, pid_t pid)
+{
+	return is_desc_process(ancestor, pid);
+}
+
+pid_t query_window_pid(xcb_connection_t *con, Window w)
 {
 	int result = 0;
 
@@ -536,8 +1456,8 @@ pid_t get_window_pid(Iguassu *i, Window w)
 	spec.mask = XCB_RES_CLIENT_ID_MASK_LOCAL_CLIENT_PID;
 
 	xcb_generic_error_t *e = NULL;
-	xcb_res_query_client_ids_cookie_t c = xcb_res_query_client_ids(i->xcb_con, 1, &spec);
-	xcb_res_query_client_ids_reply_t *r = xcb_res_query_client_ids_reply(i->xcb_con, c, &e);
+	xcb_res_query_client_ids_cookie_t c = xcb_res_query_client_ids(con, 1, &spec);
+	xcb_res_query_client_ids_reply_t *r = xcb_res_query_client_ids_reply(con, c, &e);
 
 	if (!r)
 		return (pid_t) 0;
@@ -559,260 +1479,2076 @@ pid_t get_window_pid(Iguassu *i, Window w)
 	return result;
 }
 
-int try_manage_from_new(Iguassu *i, Window win, pid_t pid, char *name)
+pid_t get_window_pid(Iguassu *i, Window w)
 {
-	if (pid == 0)
+	/* Every stand-in window is ours, so they'd all end up together. */
+	if (i->log.play != NULL)
 		return 0;
+	return query_window_pid(i->xcb_con, w);
+}
 
-	for (Container *c = i->containers; c != NULL; c = c->next) {
-		if (c->clients->pid == pid && c->clients->id == None) {
-			c->clients->id = win;
-			c->clients->name = name;
-			reshape_container(i, c);
-			focus_container(i, c);
-			return 1;
+int resolve_push(ResolveQueue *q, Resolve *r)
+{
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&q->tail, memory_order_acquire) == RESOLVE_QUEUE)
+		return 0;
+	q->slots[head % RESOLVE_QUEUE] = *r;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return 1;
+}
+
+int resolve_pop(ResolveQueue *q, Resolve *r)
+{
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	if (tail == atomic_load_explicit(&q->head, memory_order_acquire))
+		return 0;
+	*r = q->slots[tail % RESOLVE_QUEUE];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+void *resolver_thread(void *arg)
+{
+	Resolver *r = arg;
+	Resolve job;
+	uint64_t n;
+
+	for (;;) {
+		if (read(r->wake_worker, &n, sizeof(n)) != sizeof(n))
+			continue;
+		while (resolve_pop(&r->req, &job)) {
+			job.pid = query_window_pid(r->con, job.win);
+			job.n = 0;
+			for (pid_t p = job.pid; p > 0 && job.n < RESOLVE_DEPTH; p = get_parent_pid(p))
+				job.line[job.n++] = p;
+			while (!resolve_push(&r->res, &job))
+				usleep(1000);
+			n = 1;
+			write(r->wake_main, &n, sizeof(n));
 		}
 	}
 
-	return 0;
+	return NULL;
 }
 
-int try_manage_on_container(Iguassu *i, Window win, pid_t pid, char *name)
+void resolver_start(Iguassu *i)
 {
-	Client *new_client;
-	int x, y;
-	unsigned int width, height, _dumbu;
-	Window _dumbw;
-
-	for (Container *c = i->containers; c != NULL; c = c->next) {
-		if (is_desc_process(c->clients->pid, pid) && c->clients->id != None) {
-			new_client = malloc(sizeof(Client));
-			assert(new_client != NULL && "Buy more ram lol");
-
-			XGetGeometry(i->dpy, c->clients->id, &_dumbw, &x, &y, &width, &height, &_dumbu, &_dumbu);
-			XMoveResizeWindow(i->dpy, win, x, y, width, height);
-			new_client->next = c->clients;
-			new_client->pid = pid;
-			new_client->name = name;
-			new_client->id = win;
-			c->clients = new_client;
+	Resolver *r = calloc(1, sizeof(Resolver));
+	pthread_t th;
+
+	i->resolver = NULL;
+	i->resolve_wakes = 0;
+	assert(r != NULL && "Buy more ram lol");
+
+	r->con = xcb_connect(NULL, NULL);
+	r->wake_worker = eventfd(0, EFD_CLOEXEC);
+	r->wake_main = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (xcb_connection_has_error(r->con)
+		|| r->wake_worker < 0
+		|| r->wake_main < 0
+		|| pthread_create(&th, NULL, resolver_thread, r)) {
+		fprintf(stderr, "iguassu: cannot start the resolver, finding pids right away\n");
+		/* Even a failed connection has to be let go. */
+		xcb_disconnect(r->con);
+		if (r->wake_worker >= 0)
+			close(r->wake_worker);
+		if (r->wake_main >= 0)
+			close(r->wake_main);
+		free(r);
+		return;
+	}
+	pthread_detach(th);
+	i->resolver = r;
+}
 
-			focus_container(i, c);
+/* Asks the resolver for the process of win. Returns 0 if it can't, so it
+ * must be found right away. */
+int resolve_post(Iguassu *i, Window win)
+{
+	Resolve job = { .win = win };
+	uint64_t n = 1;
 
-			return 1;
+	if (i->resolver == NULL || !resolve_push(&i->resolver->req, &job))
+		return 0;
+	write(i->resolver->wake_worker, &n, sizeof(n));
+	return 1;
+}
+
+/* What every managed window needs from us, whatever container it goes to. */
+void adopt(Iguassu *i, Window win)
+{
+	grab_buttons(i, win);
+
+	/* Just the name. Everything else comes from the root or the button
+	 * grabs. */
+#ifdef FOCUS_FOLLOWS_MOUSE
+	XSelectInput(i->dpy, win, PropertyChangeMask | EnterWindowMask);
+#else
+	XSelectInput(i->dpy, win, PropertyChangeMask);
+#endif
+
+	XSetWindowBorder(i->dpy, win, BORDER_NORMAL);
+	XSetWindowBorderWidth(i->dpy, win, BORDER_WIDTH);
+#ifdef THUMBNAILS
+	thumb_watch(i, win);
+#endif
+}
+
+pid_t spawn_terminal(void)
+{
+	pid_t pid = fork();
+	assert(pid != -1 && "wtf cannot fork lol");
+	if (pid == 0) {
+		execlp(TERMINAL, TERMINAL, NULL);
+		exit(1);
+	}
+	return pid;
+}
+
+int proc_stat_open(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* The name may have spaces and parentheses, so the fields start after the
+ * last ')'. ppid is the 4th, utime and stime the 14th and 15th and rss (in
+ * pages) the 24th. Returns 0 if the process is gone. */
+int proc_stat_read(int fd, pid_t *ppid, unsigned long long int *ticks, long int *rss)
+{
+	char buf[512], *p;
+	unsigned long int ut, st;
+	ssize_t n;
+
+	if ((n = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0)
+		return 0;
+	buf[n] = '\0';
+	if ((p = strrchr(buf, ')')) == NULL
+		|| sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu"
+			" %*d %*d %*d %*d %*d %*d %*u %*u %ld", ppid, &ut, &st, rss) != 4)
+		return 0;
+	*ticks = ut + st;
+	return 1;
+}
+
+/* Resident memory of a process, in kB, 0 if it's gone. */
+long process_memory(pid_t p)
+{
+	unsigned long long int ticks;
+	long int rss;
+	pid_t ppid;
+	int fd, ok;
+
+	if ((fd = proc_stat_open(p)) < 0)
+		return 0;
+	ok = proc_stat_read(fd, &ppid, &ticks, &rss);
+	close(fd);
+
+	return ok ? rss * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+}
+
+/* Starts terminals until there are TERMINAL_POOL of them, as long as they fit
+ * in TERMINAL_POOL_MEMORY. One that didn't show its window yet is still
+ * starting and counts as TERMINAL_MEMORY. */
+void pool_fill(Iguassu *i)
+{
+	Spare *s, **p;
+	long mem = 0, m;
+	int n = 0;
+
+	if (i->log.play != NULL)
+		return;
+
+	for (p = &i->pool; (s = *p) != NULL;) {
+		/* Died before showing a window. */
+		if (s->id == None && kill(s->pid, 0) != 0) {
+			*p = s->next;
+			free(s);
+			continue;
 		}
+		if (s->id == None || (m = process_memory(s->pid)) == 0)
+			m = TERMINAL_MEMORY;
+		mem += m;
+		n++;
+		p = &s->next;
+	}
+
+	for (; n < TERMINAL_POOL && mem < TERMINAL_POOL_MEMORY; n++) {
+		s = malloc(sizeof(Spare));
+		assert(s != NULL && "Buy more ram lol");
+		s->pid = spawn_terminal();
+		s->id = None;
+		s->next = i->pool;
+		i->pool = s;
+		mem += TERMINAL_MEMORY;
 	}
+}
+
+/* Keeps the window in the pool if it's from a spare terminal. It's mapped
+ * out of the screen, like hidden windows with KEEP_MAPPED, so it's already
+ * drawn when taken. */
+int pool_adopt(Iguassu *i, Window win, pid_t pid, XWindowAttributes *wa)
+{
+	if (pid == 0)
+		return 0;
 
+	for (Spare *s = i->pool; s != NULL; s = s->next) {
+		if (s->pid == pid && (s->id == None || s->id == win)) {
+			s->id = win;
+			s->x = wa->x;
+			s->y = wa->y;
+			s->w = wa->width;
+			s->h = wa->height;
+			XMoveWindow(i->dpy, win, i->m.sw, wa->y);
+			XMapWindow(i->dpy, win);
+			return 1;
+		}
+	}
 	return 0;
 }
 
-void manage_new(Iguassu *i, Window win, pid_t pid, char *name)
+int pool_remove(Iguassu *i, Window win)
 {
-	new_container(i, win, name, pid, 1, 0);
-	restore_focus(i);
+	Spare *s;
+
+	for (Spare **p = &i->pool; (s = *p) != NULL; p = &s->next) {
+		if (s->id == win) {
+			*p = s->next;
+			free(s);
+			return 1;
+		}
+	}
+	return 0;
 }
 
-void manage(Iguassu *i, Window win)
+/* Gives a ready terminal to the user, exactly like a new one would appear,
+ * and starts another in its place. */
+int pool_take(Iguassu *i)
 {
 	XTextProperty prop;
-	pid_t pid = get_window_pid(i, win);
-	char *name;
+	char *name = NULL;
+	Client *cli;
+	Spare *s;
+	Window win;
+
+	for (s = i->pool; s != NULL && s->id == None; s = s->next)
+		;
+	if (s == NULL)
+		return 0;
 
+	win = s->id;
 	if (XGetWMName(i->dpy, win, &prop))
 		name = (char*) prop.value;
-	else
-		name = NULL;
+	adopt(i, win);
+	new_container(i, win, name, s->pid, 0, 1);
+	set_geometry(i->m.containers->clients, s->x, s->y, s->w, s->h);
+	pool_remove(i, win);
+	reshape_container(i, i->m.containers);
+	/* Still out of the screen unless it was reshaped. */
+	cli = find_window(i, win);
+	if (!cli->offscreen)
+		XMoveWindow(i->dpy, win, cli->x, cli->y);
+	focus_container(i, find_container(i, win));
+
+	pool_fill(i);
+	return 1;
+}
 
-	XGrabButton(i->dpy,
-		AnyButton,
-		AnyModifier,
-		win,
-		False,
-		ButtonPressMask,
-		GrabModeAsync,
-		GrabModeSync,
-		None,
-		None);
+long long int now_ms(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
 
-	XSelectInput(i->dpy,
-		win,
-		PointerMotionMask
-		| PropertyChangeMask);
+void pending_add(Iguassu *i, pid_t pid)
+{
+	if (pid <= 0)
+		return;
+	if (i->npending == i->pending_cap) {
+		i->pending_cap = i->pending_cap ? i->pending_cap * 2 : 8;
+		i->pending = realloc(i->pending, i->pending_cap * sizeof(Pending));
+		assert(i->pending != NULL && "Buy more ram lol");
+	}
+	i->pending[i->npending].pid = pid;
+	i->pending[i->npending++].deadline = now_ms() + SPAWN_TIMEOUT;
+}
 
-	XSetWindowBorder(i->dpy, win, BORDER_NORMAL);
-	XSetWindowBorderWidth(i->dpy, win, BORDER_WIDTH);
+/* Returns if it was there. */
+int pending_take(Iguassu *i, pid_t pid)
+{
+	for (int j = 0; j < i->npending; j++) {
+		if (i->pending[j].pid == pid) {
+			i->pending[j] = i->pending[--i->npending];
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	if (try_manage_from_new(i, win, pid, name))
-		return;
-	if (try_manage_on_container(i, win, pid, name))
+/* Forgets the spawns that didn't show a window in time. Returns how long
+ * (ms) until the next one expires, or -1 if there's none, to be used as the
+ * event loop timeout. */
+int pending_expire(Iguassu *i)
+{
+	long long int now = now_ms(), next = -1;
+
+	for (int j = 0; j < i->npending;) {
+		if (i->pending[j].deadline <= now) {
+			i->pending[j] = i->pending[--i->npending];
+			continue;
+		}
+		if (next < 0 || i->pending[j].deadline - now < next)
+			next = i->pending[j].deadline - now;
+		j++;
+	}
+	return next;
+}
+
+#ifdef FOCUS_FOLLOWS_MOUSE
+/* The pointer entering a window only focuses it after FOCUS_DELAY ms, so
+ * crossing others on the way doesn't raise every one of them. */
+void enter_notify(Iguassu *i, XEvent *ev)
+{
+	XCrossingEvent *e = &ev->xcrossing;
+
+	/* Grabs and pointer moves into subwindows aren't the user going
+	 * somewhere else. */
+	if (e->mode != NotifyNormal || e->detail == NotifyInferior)
 		return;
-	manage_new(i, win, pid, name);
+	i->enter_win = e->window;
+	i->enter_deadline = now_ms() + FOCUS_DELAY;
 }
 
-void map_requested(Iguassu *i, XEvent *ev)
+/* Focuses the entered window if it's time and returns how long until it is
+ * (ms), or -1. */
+int enter_expire(Iguassu *i)
 {
-	XWindowAttributes wa;
-	XMapRequestEvent *e = &ev->xmaprequest;
+	Container *c;
+	long long int left;
+
+	if (i->enter_win == None)
+		return -1;
+	left = i->enter_deadline - now_ms();
+	if (left > 0)
+		return left;
+
+	c = find_container(i, i->enter_win);
+	i->enter_win = None;
+	if (c != NULL && c != get_current(i) && c->desk == i->m.desk && !c->hidden)
+		focus_container(i, c);
+	return -1;
+}
+#endif
 
-	if (!XGetWindowAttributes(i->dpy, e->window, &wa)
-		|| wa.override_redirect
-		|| managed(i, e->window))
+#ifdef COMPOSITE
+/* The server keeps what every window shows in a pixmap of its own (and still
+ * puts it on the screen), so thumbnails and the overview can read it. */
+void composite_init(Iguassu *i)
+{
+	int ev, err;
 
+	i->composite = 0;
+	if (!XCompositeQueryExtension(i->dpy, &ev, &err)
+		|| !XDamageQueryExtension(i->dpy, &i->damage_event, &err))
+		return;
+#ifdef OVERVIEW
+	if (!XRenderQueryExtension(i->dpy, &ev, &err))
 		return;
-	manage(i, e->window);
+#endif
+	XCompositeRedirectSubwindows(i->dpy, i->root, CompositeRedirectAutomatic);
+	i->composite = 1;
 }
+#endif
+
+#ifdef THUMBNAILS
+/*
+ * Thumbnails of the windows, shown next to the hidden ones in the main menu.
+ * The server keeps the contents of every window (XComposite) and tells when
+ * they change (XDamage). A window is read back and scaled down here when
+ * it's hidden, if it changed since the last time. With KEEP_MAPPED hidden
+ * windows can still be read, so the ones that change are read again while
+ * idle, at most every THUMB_INTERVAL ms each. Windows on the screen never are,
+ * as they can't be in the menu of hidden ones.
+ */
+#define THUMB_SIZE (THUMB_WIDTH * THUMB_HEIGHT * 4)
 
-void remove_null_container(Iguassu *i, Container *c)
+void thumbs_init(Iguassu *i)
 {
-	assert(c->clients == NULL);
+	i->thumbs = NULL;
+	i->nthumbs = 0;
+	i->thumb_shm_size = 0;
+	if (!i->composite)
+		return;
+	i->thumb_shm_ok = XShmQueryExtension(i->dpy);
+	i->thumb_win = XCreateSimpleWindow(
+		i->dpy,
+		i->root,
+		0,
+		0,
+		THUMB_WIDTH,
+		THUMB_HEIGHT,
+		BORDER_WIDTH,
+		MENU_BORDER_COLOR,
+		MENU_BACKGROUND_COLOR);
+}
 
-	if (c->prev != NULL)
-		c->prev->next = c->next;
-	if (c->next != NULL)
-		c->next->prev = c->prev;
-	if (i->containers == c)
-		i->containers = c->next;
-	free(c);
+Thumb *thumb_find(Iguassu *i, Window win)
+{
+	for (Thumb *t = i->thumbs; t != NULL; t = t->next)
+		if (t->win == win)
+			return t;
+	return NULL;
 }
 
-void unmanage(Iguassu *i, Container *c, Window win)
+void thumb_watch(Iguassu *i, Window win)
 {
-	Client *prev = NULL;
-	for (Client *cli = c->clients; cli != NULL; cli = cli->next) {
-		if (cli->id == win) {
-			if (prev != NULL)
-				prev->next = cli->next;
-			else if (c->clients == cli)
-				c->clients = cli->next;
-			if (cli->name != NULL)
-				XFree(cli->name);
-			free(cli);
-			break;
-		}
+	Thumb *t;
 
-		prev = cli;
-	}
+	if (!i->composite || thumb_find(i, win) != NULL)
+		return;
+	t = calloc(1, sizeof(Thumb));
+	assert(t != NULL && "Buy more ram lol");
+	t->win = win;
+	t->damage = XDamageCreate(i->dpy, win, XDamageReportNonEmpty);
+	t->dirty = 1;
+	t->next = i->thumbs;
+	i->thumbs = t;
+}
 
-	if (c->clients == NULL)
-		remove_null_container(i, c);
+void thumb_drop(Iguassu *i, Thumb *t)
+{
+	if (t->pix != None) {
+		XFreePixmap(i->dpy, t->pix);
+		t->pix = None;
+		i->nthumbs--;
+	}
+}
 
-	restore_focus(i);
+/* The window is gone, and its damage with it. */
+void thumb_forget(Iguassu *i, Window win)
+{
+	Thumb *t;
+
+	for (Thumb **p = &i->thumbs; (t = *p) != NULL; p = &t->next) {
+		if (t->win == win) {
+			*p = t->next;
+			thumb_drop(i, t);
+			free(t);
+			return;
+		}
+	}
 }
 
-void destroy_notify(Iguassu *i, XEvent *ev)
+void thumb_damaged(Iguassu *i, XEvent *ev)
 {
-	XDestroyWindowEvent *e = &ev->xdestroywindow;
-	Container *c = find_container(i, e->window);
-	if (c != NULL)
-		unmanage(i, c, e->window);
+	Thumb *t = thumb_find(i, ((XDamageNotifyEvent*) ev)->drawable);
+	if (t != NULL)
+		t->dirty = 1;
 }
 
-void hide(Iguassu *i, Window win)
+/* Adds the channels of a row to the sums of its columns. */
+void thumb_add_row(uint32_t *acc, const uint8_t *row, int w)
 {
-	Container *c = find_container(i, win);
-	if (c != NULL) {
-		c->hidden = 1;
-		restore_focus(i);
+	int x = 0;
+
+#ifdef __SSE2__
+	__m128i z = _mm_setzero_si128();
+	for (; x + 4 <= w; x += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i*) (row + x * 4));
+		__m128i lo = _mm_unpacklo_epi8(p, z);
+		__m128i hi = _mm_unpackhi_epi8(p, z);
+		__m128i *a = (__m128i*) (acc + x * 4);
+		_mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a), _mm_unpacklo_epi16(lo, z)));
+		_mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(lo, z)));
+		_mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(hi, z)));
+		_mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(hi, z)));
 	}
+#endif
+	for (x *= 4; x < w * 4; x++)
+		acc[x] += row[x];
 }
 
-void unhide_by_idx(Iguassu *i, int n)
+/* Box filter: every pixel of dst is the average of the pixels of src that
+ * fall in it. The rows of a box are summed per column first, which is most of
+ * the work, then the columns of each box. Both are 32 bits per pixel. */
+void thumb_scale(const uint8_t *src, int stride, int sw, int sh, uint8_t *dst, int dstride, int dw, int dh)
 {
-	for (Container *c = i->containers; c != NULL; c = c->next) {
-		if (c->hidden) {
-			n--;
-			if (n == 0) {
-				c->hidden = 0;
-				focus_container(i, c);
-				return;
-			}
+	static uint32_t *acc;
+	static int cap;
+	uint64_t sum[4];
+	int x0, x1, y0, y1, n;
+
+	if (sw > cap) {
+		cap = sw;
+		acc = realloc(acc, cap * 4 * sizeof(uint32_t));
+		assert(acc != NULL && "Buy more ram lol");
+	}
+
+	for (int y = 0; y < dh; y++) {
+		y0 = y * sh / dh;
+		y1 = MAX((y + 1) * sh / dh, y0 + 1);
+		memset(acc, 0, sw * 4 * sizeof(uint32_t));
+		for (int sy = y0; sy < y1; sy++)
+			thumb_add_row(acc, src + (size_t) sy * stride, sw);
+
+		for (int x = 0; x < dw; x++) {
+			x0 = x * sw / dw;
+			x1 = MAX((x + 1) * sw / dw, x0 + 1);
+			n = (x1 - x0) * (y1 - y0);
+			sum[0] = sum[1] = sum[2] = sum[3] = 0;
+			for (int sx = x0; sx < x1; sx++)
+				for (int ch = 0; ch < 4; ch++)
+					sum[ch] += acc[sx * 4 + ch];
+			for (int ch = 0; ch < 4; ch++)
+				dst[y * dstride + x * 4 + ch] = sum[ch] / n;
 		}
 	}
 }
 
-int draw_main_menu(Iguassu *i, int x, int y, int cur_x, int cur_y, int w, int h, int n_hid)
+/* Makes room for one more picture in THUMB_BUDGET, dropping the ones not
+ * shown for the longest. */
+void thumbs_budget(Iguassu *i)
 {
-	int j, in_menu;
-	int r = -1;
-
-	drw_rect(i->menu_drw, 0, 0, w, h * (5 + n_hid), 1, 0);
+	Thumb *old;
+
+	while (i->nthumbs > 0 && (i->nthumbs + 1) * (THUMB_SIZE / 1024) > THUMB_BUDGET) {
+		old = NULL;
+		for (Thumb *t = i->thumbs; t != NULL; t = t->next)
+			if (t->pix != None && (old == NULL || t->used < old->used))
+				old = t;
+		thumb_drop(i, old);
+	}
+}
 
-	in_menu = cur_x >= 0 && cur_y >= 0 && cur_x <= h * (5 + n_hid) && cur_y <= w;
-	for (j = 0; j < 5; j++) {
-		if (in_menu && cur_x >= h * j && cur_x < h * (j + 1)) {
-			drw_setscheme(i->menu_drw, i->menu_color_f);
-			r = j;
+/* Reads the pixmap through the shared segment, growing it if needed. NULL if
+ * the server can't, and then it isn't tried again. */
+XImage *thumb_shm_get(Iguassu *i, Pixmap p, unsigned int w, unsigned int h, unsigned int depth)
+{
+	XShmSegmentInfo *s = &i->thumb_shm;
+	XImage *img;
+	size_t size;
+
+	img = XShmCreateImage(i->dpy, DefaultVisual(i->dpy, i->screen), depth,
+		ZPixmap, NULL, s, w, h);
+	if (img == NULL) {
+		i->thumb_shm_ok = 0;
+		return NULL;
+	}
+
+	size = (size_t) img->bytes_per_line * h;
+	if (size > i->thumb_shm_size) {
+		if (i->thumb_shm_size > 0) {
+			XShmDetach(i->dpy, s);
+			shmdt(s->shmaddr);
+			i->thumb_shm_size = 0;
+		}
+		s->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+		s->shmaddr = s->shmid < 0 ? (char*) -1 : shmat(s->shmid, NULL, 0);
+		s->readOnly = False;
+		if (s->shmaddr == (char*) -1) {
+			if (s->shmid >= 0)
+				shmctl(s->shmid, IPC_RMID, NULL);
+			goto fail;
+		}
+		XShmAttach(i->dpy, s);
+		XSync(i->dpy, False);
+		/* Both sides are attached, so it goes away when both detach. */
+		shmctl(s->shmid, IPC_RMID, NULL);
+		i->thumb_shm_size = size;
+	}
+
+	img->data = s->shmaddr;
+	/* The pixmap is there (we just got its geometry), so this failing
+	 * means the server couldn't attach. */
+	if (XShmGetImage(i->dpy, p, img, 0, 0, AllPlanes))
+		return img;
+fail:
+	img->data = NULL;
+	XDestroyImage(img);
+	i->thumb_shm_ok = 0;
+	return NULL;
+}
+
+/* Reads the window back and scales it down, keeping its proportions. */
+void thumb_capture(Iguassu *i, Thumb *t)
+{
+	static uint32_t buf[THUMB_WIDTH * THUMB_HEIGHT];
+	Pixmap p;
+	XImage *img = NULL, *out;
+	Window root;
+	int x, y, tw, th, shm = 0;
+	unsigned int w, h, bw, depth;
+
+	t->dirty = 0;
+	t->captured = now_ms();
+	if (t->used == 0)
+		t->used = t->captured;
+	XDamageSubtract(i->dpy, t->damage, None, None);
+
+	/* Not viewable (hidden or in another desktop) is an error here. */
+	p = XCompositeNameWindowPixmap(i->dpy, t->win);
+	if (!XGetGeometry(i->dpy, p, &root, &x, &y, &w, &h, &bw, &depth)) {
+		XFreePixmap(i->dpy, p);
+		return;
+	}
+	if (i->thumb_shm_ok)
+		shm = (img = thumb_shm_get(i, p, w, h, depth)) != NULL;
+	if (img == NULL)
+		img = XGetImage(i->dpy, p, 0, 0, w, h, AllPlanes, ZPixmap);
+	XFreePixmap(i->dpy, p);
+	if (img == NULL)
+		return;
+	if (img->bits_per_pixel != 32)
+		goto done;
+
+	if (w * THUMB_HEIGHT > h * THUMB_WIDTH) {
+		tw = THUMB_WIDTH;
+		th = MAX(h * THUMB_WIDTH / w, 1);
+	} else {
+		th = THUMB_HEIGHT;
+		tw = MAX(w * THUMB_HEIGHT / h, 1);
+	}
+	for (int j = 0; j < THUMB_WIDTH * THUMB_HEIGHT; j++)
+		buf[j] = MENU_BACKGROUND_COLOR;
+	thumb_scale((uint8_t*) img->data, img->bytes_per_line, w, h,
+		(uint8_t*) (buf + (THUMB_HEIGHT - th) / 2 * THUMB_WIDTH + (THUMB_WIDTH - tw) / 2),
+		THUMB_WIDTH * 4, tw, th);
+
+	if (t->pix == None) {
+		thumbs_budget(i);
+		t->pix = XCreatePixmap(i->dpy, i->root, THUMB_WIDTH, THUMB_HEIGHT,
+			DefaultDepth(i->dpy, i->screen));
+		i->nthumbs++;
+	}
+	out = XCreateImage(i->dpy, DefaultVisual(i->dpy, i->screen),
+		DefaultDepth(i->dpy, i->screen), ZPixmap, 0, (char*) buf,
+		THUMB_WIDTH, THUMB_HEIGHT, 32, 0);
+	if (out != NULL) {
+		XPutImage(i->dpy, t->pix, DefaultGC(i->dpy, i->screen), out, 0, 0, 0, 0,
+			THUMB_WIDTH, THUMB_HEIGHT);
+		/* It's our buffer. */
+		out->data = NULL;
+		XDestroyImage(out);
+	}
+
+done:
+	/* The segment stays ours. */
+	if (shm)
+		img->data = NULL;
+	XDestroyImage(img);
+}
+
+/* Only the top window of a hidden container is ever shown, and only
+ * KEEP_MAPPED leaves it where it can be read. */
+int thumb_wanted(Iguassu *i, Thumb *t)
+{
+#ifdef KEEP_MAPPED
+	Container *c = find_container(i, t->win);
+	return c != NULL && c->hidden && c->clients->id == t->win;
+#else
+	return 0;
+#endif
+}
+
+/* Captures the windows that drew, can be shown and are due. Returns how long
+ * until the next one is (ms), or -1. */
+int thumbs_update(Iguassu *i)
+{
+	long long int now = now_ms(), left, next = -1;
+
+	if (!i->composite)
+		return -1;
+	for (Thumb *t = i->thumbs; t != NULL; t = t->next) {
+		if (!t->dirty || !thumb_wanted(i, t))
+			continue;
+		left = t->captured + THUMB_INTERVAL - now;
+		if (left <= 0)
+			thumb_capture(i, t);
+		else if (next < 0 || left < next)
+			next = left;
+	}
+	return next;
+}
+#endif
+
+int try_manage_from_new(Iguassu *i, Window win, pid_t pid, char *name, XWindowAttributes *wa)
+{
+	Container *c;
+
+	if (pid == 0 || !pending_take(i, pid))
+		return 0;
+
+	new_container(i, win, name, pid, 0, 1);
+	c = i->m.containers;
+	set_geometry(c->clients, wa->x, wa->y, wa->width, wa->height);
+	reshape_container(i, c);
+	focus_container(i, c);
+	return 1;
+}
+
+/* Puts win on top of c, where c's top client is, without focusing it. */
+void add_to_container(Iguassu *i, Container *c, Window win, char *name, pid_t pid)
+{
+	Client *new_client;
+	int x = c->clients->offscreen ? c->clients->hx : c->clients->x;
+	int y = c->clients->offscreen ? c->clients->hy : c->clients->y;
+
+	new_client = model_add_client(&i->m, c, win, name, pid);
+	move_resize_client(i, new_client, x, y,
+		new_client->next->w, new_client->next->h);
+}
+
+void join_container(Iguassu *i, Container *c, Window win, char *name, pid_t pid)
+{
+	add_to_container(i, c, win, name, pid);
+	focus_container(i, c);
+}
+
+int try_manage_on_container(Iguassu *i, Window win, pid_t pid, char *name)
+{
+	Container *c = model_group(&i->m, i->m.desk, NULL, pid, started_by, NULL);
+
+	if (c == NULL)
+		return 0;
+	join_container(i, c, win, name, pid);
+	return 1;
+}
+
+/* The resolver already walked up from the pid. */
+int in_line(void *ctx, pid_t ancestor, pid_t pid)
+{
+	Resolve *job = ctx;
+
+	for (int k = 0; k < job->n; k++)
+		if (job->line[k] == ancestor)
+			return 1;
+	return 0;
+}
+
+/* The answer for a window that was managed on its own before its process
+ * was known: if it belongs to the program of another container of its
+ * desktop, it goes there like it would've gone in the first place. It only
+ * takes the focus along if it still has it, as the answer can come after
+ * the user moved on. */
+void resolved(Iguassu *i, Resolve *job)
+{
+	Container *c = find_container(i, job->win);
+	Container *t;
+	Client *cli;
+	char *name;
+	int focused;
+
+	if (c == NULL)
+		return;
+	cli = find_window(i, job->win);
+	cli->pid = job->pid;
+	if (c->clients != cli || cli->next != NULL)
+		return;
+
+	if ((t = model_group(&i->m, c->desk, c, job->pid, in_line, job)) == NULL)
+		return;
+	focused = c->desk == i->m.desk && model_current(&i->m) == c;
+	name = cli->name;
+	free(model_remove_client(&i->m, c, job->win));
+	if (focused) {
+		join_container(i, t, job->win, name, job->pid);
+	} else {
+		add_to_container(i, t, job->win, name, job->pid);
+		restore_focus(i);
+	}
+}
+
+void resolve_results(Iguassu *i)
+{
+	Resolve job;
+
+	if (i->resolver == NULL)
+		return;
+	while (resolve_pop(&i->resolver->res, &job))
+		resolved(i, &job);
+}
+
+/* What we started is waiting for its window. */
+int spawns_waiting(Iguassu *i)
+{
+	if (i->npending > 0)
+		return 1;
+	for (Spare *s = i->pool; s != NULL; s = s->next)
+		if (s->id == None)
+			return 1;
+	return 0;
+}
+
+#ifdef AUTO_PLACE
+void rect_push(Rect **r, int *n, int *cap, int x, int y, int w, int h)
+{
+	if (w <= 0 || h <= 0)
+		return;
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 16;
+		*r = realloc(*r, *cap * sizeof(Rect));
+		assert(*r != NULL && "Buy more ram lol");
+	}
+	(*r)[(*n)++] = (Rect) { x, y, w, h };
+}
+
+/* Left to right, and the biggest first among the ones starting at the same
+ * column, as that's the only one that may hold the others. */
+int rect_x_cmp(const void *a, const void *b)
+{
+	const Rect *ra = a, *rb = b;
+	long int aa = (long int) ra->w * ra->h, ab = (long int) rb->w * rb->h;
+
+	if (ra->x != rb->x)
+		return (ra->x > rb->x) - (ra->x < rb->x);
+	return (aa < ab) - (aa > ab);
+}
+
+/* Drops every rectangle inside another one, sweeping from the left: a
+ * rectangle can only be inside one that starts before it, and once the sweep
+ * is past the right edge of a kept one that one can't hold anything else. */
+void rect_prune(FreeSpace *f)
+{
+	static int *active;
+	static int acap;
+	int na = 0, kept = 0, k, a;
+
+	if (acap < f->n) {
+		acap = f->n;
+		active = realloc(active, acap * sizeof(int));
+		assert(active != NULL && "Buy more ram lol");
+	}
+	qsort(f->r, f->n, sizeof(Rect), rect_x_cmp);
+
+	for (int j = 0; j < f->n; j++) {
+		Rect r = f->r[j];
+		for (a = k = 0; k < na; k++) {
+			Rect *o = &f->r[active[k]];
+			if (o->x + o->w <= r.x)
+				continue;
+			active[a++] = active[k];
+			if (r.y >= o->y && r.x + r.w <= o->x + o->w
+				&& r.y + r.h <= o->y + o->h)
+				break;
+		}
+		/* Contained: the rest of the active ones stay as they were. */
+		if (k < na) {
+			for (k++; k < na; k++)
+				active[a++] = active[k];
+			na = a;
+			continue;
+		}
+		na = a;
+		f->r[kept] = r;
+		active[na++] = kept++;
+	}
+	f->n = kept;
+}
+
+/* Takes o out of the free space: each rectangle it touches is split in up to
+ * four around it, and the pieces left inside others are dropped. */
+void free_take(FreeSpace *f, Rect o)
+{
+	int n = f->n;
+
+	for (int j = 0; j < n; j++) {
+		Rect r = f->r[j];
+		if (o.x >= r.x + r.w || o.x + o.w <= r.x
+			|| o.y >= r.y + r.h || o.y + o.h <= r.y)
+			continue;
+		/* Replaced by its pieces, which go at the end. */
+		f->r[j] = (Rect) { 0, 0, 0, 0 };
+		rect_push(&f->r, &f->n, &f->cap, r.x, r.y, o.x - r.x, r.h);
+		rect_push(&f->r, &f->n, &f->cap, o.x + o.w, r.y, r.x + r.w - o.x - o.w, r.h);
+		rect_push(&f->r, &f->n, &f->cap, r.x, r.y, r.w, o.y - r.y);
+		rect_push(&f->r, &f->n, &f->cap, r.x, o.y + o.h, r.w, r.y + r.h - o.y - o.h);
+	}
+	for (int j = n = 0; j < f->n; j++)
+		if (f->r[j].w > 0)
+			f->r[n++] = f->r[j];
+	f->n = n;
+	rect_prune(f);
+}
+
+int obstacle_cmp(const void *a, const void *b)
+{
+	Window wa = ((const Obstacle*) a)->win, wb = ((const Obstacle*) b)->win;
+	return (wa > wb) - (wa < wb);
+}
+
+/* Brings i->free up to date with the visible windows of the current desktop
+ * but skip. Windows that showed up since the last time are just taken out of
+ * it. If any moved, resized or went away, the space they leave may join
+ * other rectangles in ways splitting can't undo, so it's made again. */
+void free_update(Iguassu *i, Container *skip)
+{
+	static Obstacle *now;
+	static int cap;
+	FreeSpace *f = &i->free;
+	int n = 0, j = 0, k, rebuild;
+
+	for (Container *c = i->m.containers; c != NULL; c = c->next) {
+		if (c->hidden || c == skip)
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 16;
+			now = realloc(now, cap * sizeof(Obstacle));
+			assert(now != NULL && "Buy more ram lol");
+		}
+		now[n++] = (Obstacle) { c->clients->id, {
+			c->clients->x,
+			c->clients->y,
+			c->clients->w + 2 * BORDER_WIDTH,
+			c->clients->h + 2 * BORDER_WIDTH,
+		} };
+	}
+	qsort(now, n, sizeof(Obstacle), obstacle_cmp);
+
+	rebuild = !f->valid || f->desk != i->m.desk;
+	for (k = 0; k < f->no && !rebuild; k++) {
+		for (; j < n && now[j].win < f->o[k].win; j++)
+			;
+		rebuild = j == n || now[j].win != f->o[k].win
+			|| memcmp(&now[j].r, &f->o[k].r, sizeof(Rect));
+	}
+
+	if (rebuild) {
+		f->n = 0;
+		rect_push(&f->r, &f->n, &f->cap, 0, 0, i->sw, i->sh);
+		for (k = 0; k < n; k++)
+			free_take(f, now[k].r);
+	} else {
+		/* Only the new ones, which are the ones not in f->o. */
+		for (j = k = 0; j < n; j++) {
+			for (; k < f->no && f->o[k].win < now[j].win; k++)
+				;
+			if (k == f->no || f->o[k].win != now[j].win)
+				free_take(f, now[j].r);
+		}
+	}
+
+	if (f->ocap < n) {
+		f->ocap = n;
+		f->o = realloc(f->o, f->ocap * sizeof(Obstacle));
+		assert(f->o != NULL && "Buy more ram lol");
+	}
+	memcpy(f->o, now, n * sizeof(Obstacle));
+	f->no = n;
+	f->desk = i->m.desk;
+	f->valid = 1;
+}
+
+/* Maximal rectangles: the free space is kept as every largest rectangle not
+ * covered by a visible window (they overlap each other), see free_update.
+ * The new client goes to the largest one it fits, or to the largest one at
+ * all if it fits nowhere. */
+void place_client(Iguassu *i, Client *cli)
+{
+	FreeSpace *f = &i->free;
+	int w = cli->w + 2 * BORDER_WIDTH;
+	int h = cli->h + 2 * BORDER_WIDTH;
+	int best = -1, fits = 0, ok;
+	long int area, best_area = -1;
+
+	free_update(i, find_container(i, cli->id));
+
+	for (int j = 0; j < f->n; j++) {
+		area = (long int) f->r[j].w * f->r[j].h;
+		ok = f->r[j].w >= w && f->r[j].h >= h;
+		if ((ok && !fits) || (ok == fits && area > best_area)) {
+			best = j;
+			best_area = area;
+			fits = ok;
+		}
+	}
+
+	if (best >= 0) {
+		move_client(i, cli,
+			MAX(MIN(f->r[best].x, i->sw - w), 0),
+			MAX(MIN(f->r[best].y, i->sh - h), 0));
+	}
+}
+
+/* Only windows being mapped now get placed, not the ones we found already on
+ * the screen. */
+int wants_placement(Iguassu *i, Window win, XWindowAttributes *wa)
+{
+	XSizeHints hints;
+	long int supplied;
+
+	if (wa->map_state == IsViewable)
+		return 0;
+	if (XGetWMNormalHints(i->dpy, win, &hints, &supplied)
+		&& hints.flags & USPosition)
+		return 0;
+	return 1;
+}
+#endif
+
+void manage_new(Iguassu *i, Window win, pid_t pid, char *name, XWindowAttributes *wa)
+{
+	new_container(i, win, name, pid, 1, 0);
+	set_geometry(i->m.containers->clients, wa->x, wa->y, wa->width, wa->height);
+#ifdef AUTO_PLACE
+	if (wants_placement(i, win, wa))
+		place_client(i, i->m.containers->clients);
+#endif
+	restore_focus(i);
+}
+
+void manage(Iguassu *i, Window win, XWindowAttributes *wa)
+{
+	TRACE_BEGIN(t);
+	XTextProperty prop;
+	pid_t pid;
+	char *name;
+
+	/* Usually the window is managed on its own right away and regrouped
+	 * when the resolver answers (see resolved). But what we spawned must
+	 * go to the right place from the start, so while something is
+	 * waiting for its window, the pid is asked here. */
+	if (!spawns_waiting(i) && resolve_post(i, win)) {
+		if (XGetWMName(i->dpy, win, &prop))
+			name = (char*) prop.value;
+		else
+			name = NULL;
+		adopt(i, win);
+		manage_new(i, win, 0, name, wa);
+		TRACE_END(t, "manage");
+		return;
+	}
+
+	pid = get_window_pid(i, win);
+	if (!pool_adopt(i, win, pid, wa)) {
+		if (XGetWMName(i->dpy, win, &prop))
+			name = (char*) prop.value;
+		else
+			name = NULL;
+
+		adopt(i, win);
+
+		if (!try_manage_from_new(i, win, pid, name, wa)
+			&& !try_manage_on_container(i, win, pid, name))
+			manage_new(i, win, pid, name, wa);
+	}
+	TRACE_END(t, "manage");
+}
+
+void map_requested(Iguassu *i, XEvent *ev)
+{
+	XWindowAttributes wa;
+	XMapRequestEvent *e = &ev->xmaprequest;
+
+	if (!XGetWindowAttributes(i->dpy, e->window, &wa)
+		|| wa.override_redirect
+		|| managed(i, e->window))
+
+		return;
+	manage(i, e->window, &wa);
+}
+
+void unmanage(Iguassu *i, Container *c, Window win)
+{
+	Client *cli = model_remove_client(&i->m, c, win);
+
+	if (cli != NULL) {
+		if (cli->name != NULL)
+			XFree(cli->name);
+		free(cli);
+	}
+	restore_focus(i);
+}
+
+void destroy_notify(Iguassu *i, XEvent *ev)
+{
+	XDestroyWindowEvent *e = &ev->xdestroywindow;
+	Container *c = find_container(i, e->window);
+#ifdef THUMBNAILS
+	thumb_forget(i, e->window);
+#endif
+	if (c != NULL)
+		unmanage(i, c, e->window);
+	else if (pool_remove(i, e->window))
+		pool_fill(i);
+}
+
+void hide(Iguassu *i, Window win)
+{
+	Container *c = find_container(i, win);
+	if (c != NULL) {
+#ifdef THUMBNAILS
+		/* The last chance to see it, unless it's the same as the last
+		 * time. */
+		Thumb *t = thumb_find(i, c->clients->id);
+		if (t != NULL && (t->dirty || t->pix == None))
+			thumb_capture(i, t);
+#endif
+		model_hide(&i->m, c);
+		restore_focus(i);
+	}
+}
+
+void unhide_by_idx(Iguassu *i, int n)
+{
+	focus_container(i, model_nth_hidden(&i->m, n));
+}
+
+/* The state given to the next iguassu on restart is: */
+#define STATE_MAGIC "IGS1"
+/* Then the number of containers and, for each one from the most recently
+ * focused, its STATE_* flags, number of clients and the window and pid of
+ * every client from the top one. Then the number of spare terminals and the
+ * window and pid of each. Then the number of clients out of the screen (see
+ * KEEP_MAPPED) and the window and saved position of each. Then the number of
+ * programs started from "New" without a window yet and the pid of each. Then
+ * the current desktop. Everything is native-endian, as it's read by the
+ * same build on the same machine. */
+#define STATE_HIDDEN 1
+#define STATE_ALLOW_CONFIG_REQ 2
+/* The desktop goes in the upper bits of the flags. */
+#define STATE_DESK_SHIFT 4
+
+/* Restarts in place (e.g. to run a new build) keeping everything as is. The
+ * state goes in an unlinked file that the new process gets by its descriptor,
+ * and windows stay where they are on the server. */
+void restart(Iguassu *i)
+{
+	FILE *f;
+	char fd[16];
+	uint32_t n;
+	uint8_t flags;
+	int32_t pid;
+	int32_t pos[2];
+	Client *cli;
+
+	if (i->log.play != NULL || (f = tmpfile()) == NULL)
+		return;
+
+	fwrite(STATE_MAGIC, 1, 4, f);
+	n = model_n_cont(&i->m);
+	fwrite(&n, sizeof(n), 1, f);
+	for (int d = 0; d < DESKTOPS; d++) {
+		for (Container *c = *model_head(&i->m, d); c != NULL; c = c->next) {
+			flags = (c->hidden ? STATE_HIDDEN : 0)
+				| (c->allow_config_req ? STATE_ALLOW_CONFIG_REQ : 0)
+				| c->desk << STATE_DESK_SHIFT;
+			fwrite(&flags, sizeof(flags), 1, f);
+			n = 0;
+			for (cli = c->clients; cli != NULL; cli = cli->next)
+				n++;
+			fwrite(&n, sizeof(n), 1, f);
+			for (cli = c->clients; cli != NULL; cli = cli->next) {
+				n = cli->id;
+				pid = cli->pid;
+				fwrite(&n, sizeof(n), 1, f);
+				fwrite(&pid, sizeof(pid), 1, f);
+			}
+		}
+	}
+
+	n = 0;
+	for (Spare *s = i->pool; s != NULL; s = s->next)
+		n++;
+	fwrite(&n, sizeof(n), 1, f);
+	for (Spare *s = i->pool; s != NULL; s = s->next) {
+		n = s->id;
+		pid = s->pid;
+		fwrite(&n, sizeof(n), 1, f);
+		fwrite(&pid, sizeof(pid), 1, f);
+	}
+
+	n = 0;
+	for (int d = 0; d < DESKTOPS; d++)
+		for (Container *c = *model_head(&i->m, d); c != NULL; c = c->next)
+			for (cli = c->clients; cli != NULL; cli = cli->next)
+				if (cli->offscreen)
+					n++;
+	fwrite(&n, sizeof(n), 1, f);
+	for (int d = 0; d < DESKTOPS; d++) {
+		for (Container *c = *model_head(&i->m, d); c != NULL; c = c->next) {
+			for (cli = c->clients; cli != NULL; cli = cli->next) {
+				if (!cli->offscreen)
+					continue;
+				n = cli->id;
+				pos[0] = cli->hx;
+				pos[1] = cli->hy;
+				fwrite(&n, sizeof(n), 1, f);
+				fwrite(pos, sizeof(pos), 1, f);
+			}
+		}
+	}
+
+	n = i->npending;
+	fwrite(&n, sizeof(n), 1, f);
+	for (int j = 0; j < i->npending; j++) {
+		pid = i->pending[j].pid;
+		fwrite(&pid, sizeof(pid), 1, f);
+	}
+
+	n = i->m.desk;
+	fwrite(&n, sizeof(n), 1, f);
+
+	if (fflush(f) != 0) {
+		fclose(f);
+		return;
+	}
+	snprintf(fd, sizeof(fd), "%d", fileno(f));
+	XSync(i->dpy, False);
+
+	/* The connection is close-on-exec, so the server lets go of us. The
+	 * new build is wherever we were started from: /proc/self/exe is still
+	 * the old file if make or install replaced it, so it's only for when
+	 * that path doesn't work anymore. */
+	execlp(i->argv0, i->argv0, "-s", fd, NULL);
+	execl("/proc/self/exe", i->argv0, "-s", fd, NULL);
+
+	fprintf(stderr, "iguassu: cannot restart\n");
+	fclose(f);
+}
+
+/* Takes back the state left by restart(). Windows that died meanwhile are
+ * dropped and the others are adopted as they were, without looking for
+ * their processes again, unless the resolver hadn't found them yet. */
+void load_state(Iguassu *i, int fd)
+{
+	FILE *f;
+	char magic[4];
+	uint32_t nc, n, win;
+	uint8_t flags;
+	int32_t pid;
+	int32_t pos[2];
+	int nwin = 0;
+	int ndead = 0;
+	Window *dead;
+	XWindowAttributes wa;
+	Spare *spare;
+	Container *c, *next;
+	uint32_t desk = 0;
+	Client *cli, *tail;
+	xcb_get_window_attributes_cookie_t *cookies;
+	xcb_get_window_attributes_reply_t *r;
+	xcb_get_geometry_cookie_t *gcookies;
+	xcb_get_geometry_reply_t *g;
+	XTextProperty prop;
+
+	if ((f = fdopen(fd, "rb")) == NULL)
+		return;
+	rewind(f);
+
+	if (fread(magic, 1, 4, f) != 4 || memcmp(magic, STATE_MAGIC, 4) != 0
+		|| fread(&nc, sizeof(nc), 1, f) != 1)
+		goto out;
+
+	for (; nc > 0; nc--) {
+		if (fread(&flags, sizeof(flags), 1, f) != 1
+			|| fread(&n, sizeof(n), 1, f) != 1 || n == 0)
+			break;
+
+		tail = NULL;
+		for (; n > 0; n--) {
+			if (fread(&win, sizeof(win), 1, f) != 1
+				|| fread(&pid, sizeof(pid), 1, f) != 1)
+				break;
+
+			/* Placeholders of older builds. */
+			if (win == None) {
+				pending_add(i, pid);
+				continue;
+			}
+			if (tail == NULL) {
+				new_container(i, win, NULL, pid,
+					flags & STATE_ALLOW_CONFIG_REQ,
+					flags & STATE_HIDDEN);
+				i->m.containers->desk = MIN(flags >> STATE_DESK_SHIFT, DESKTOPS - 1);
+				tail = i->m.containers->clients;
+			} else {
+				cli = calloc(1, sizeof(Client));
+				assert(cli != NULL && "Buy more ram lol");
+				cli->id = win;
+				cli->pid = pid;
+				cli->grabbed = 1;
+				tail->next = cli;
+				tail = cli;
+			}
+			if (win != None)
+				nwin++;
+		}
+		if (n > 0)
+			break;
+	}
+
+	if (nc == 0 && fread(&n, sizeof(n), 1, f) == 1) {
+		for (; n > 0; n--) {
+			if (fread(&win, sizeof(win), 1, f) != 1
+				|| fread(&pid, sizeof(pid), 1, f) != 1)
+				break;
+			if (win != None && !XGetWindowAttributes(i->dpy, win, &wa))
+				continue;
+			spare = malloc(sizeof(Spare));
+			assert(spare != NULL && "Buy more ram lol");
+			spare->pid = pid;
+			spare->id = win;
+			spare->next = i->pool;
+			i->pool = spare;
+		}
+	}
+
+	if (n == 0 && fread(&n, sizeof(n), 1, f) == 1) {
+		for (; n > 0; n--) {
+			if (fread(&win, sizeof(win), 1, f) != 1
+				|| fread(pos, sizeof(pos), 1, f) != 1)
+				break;
+			if ((cli = find_window(i, win)) == NULL)
+				continue;
+#ifdef KEEP_MAPPED
+			cli->offscreen = 1;
+			cli->hx = pos[0];
+			cli->hy = pos[1];
+#else
+			/* Left by a build with KEEP_MAPPED. */
+			XMoveWindow(i->dpy, win, pos[0], pos[1]);
+#endif
+		}
+	}
+
+	if (n == 0 && fread(&n, sizeof(n), 1, f) == 1) {
+		for (; n > 0; n--) {
+			if (fread(&pid, sizeof(pid), 1, f) != 1)
+				break;
+			pending_add(i, pid);
+		}
+	}
+
+	if (n == 0 && fread(&n, sizeof(n), 1, f) == 1 && n < DESKTOPS)
+		desk = n;
+
+	/* new_container pushes to the front, so now they are in reverse and all
+	 * in the same list. Pushing them again to their desktops fixes both. */
+	for (c = i->m.containers; c != NULL; c = next) {
+		next = c->next;
+		c->prev = NULL;
+		c->next = i->m.desks[c->desk];
+		if (c->next != NULL)
+			c->next->prev = c;
+		i->m.desks[c->desk] = c;
+	}
+	i->m.desk = desk;
+	i->m.containers = i->m.desks[desk];
+	i->m.desks[desk] = NULL;
+
+	/* Ask if every window is still there, and its geometry, in a single
+	 * round trip. */
+	cookies = malloc(nwin * sizeof(*cookies) + 1);
+	gcookies = malloc(nwin * sizeof(*gcookies) + 1);
+	dead = malloc(nwin * sizeof(Window) + 1);
+	assert(cookies != NULL && gcookies != NULL && dead != NULL && "Buy more ram lol");
+	n = 0;
+	for (int d = 0; d < DESKTOPS; d++) {
+		for (c = *model_head(&i->m, d); c != NULL; c = c->next) {
+			for (cli = c->clients; cli != NULL; cli = cli->next) {
+				cookies[n] = xcb_get_window_attributes(i->xcb_con, cli->id);
+				gcookies[n++] = xcb_get_geometry(i->xcb_con, cli->id);
+			}
+		}
+	}
+
+	n = 0;
+	for (int d = 0; d < DESKTOPS; d++) {
+		for (c = *model_head(&i->m, d); c != NULL; c = c->next) {
+			for (cli = c->clients; cli != NULL; cli = cli->next) {
+				r = xcb_get_window_attributes_reply(i->xcb_con, cookies[n], NULL);
+				g = xcb_get_geometry_reply(i->xcb_con, gcookies[n++], NULL);
+				if (r == NULL || g == NULL) {
+					free(r);
+					free(g);
+					dead[ndead++] = cli->id;
+					continue;
+				}
+				set_geometry(cli, g->x, g->y, g->width, g->height);
+				free(r);
+				free(g);
+
+				adopt(i, cli->id);
+				if (XGetWMName(i->dpy, cli->id, &prop))
+					set_client_name(i, cli, (char*) prop.value);
+				if (cli->pid == 0 && !resolve_post(i, cli->id))
+					cli->pid = get_window_pid(i, cli->id);
+			}
+		}
+	}
+	free(cookies);
+	free(gcookies);
+
+	for (n = 0; n < ndead; n++)
+		if ((c = find_container(i, dead[n])) != NULL)
+			unmanage(i, c, dead[n]);
+	free(dead);
+
+	restore_focus(i);
+
+out:
+	fclose(f);
+}
+
+#ifdef MENU_STATS
+/*
+ * The menu of windows can show how much CPU and memory each one is using,
+ * counting its client and everything the client started, like the shell of
+ * a terminal and the jobs of the shell. A process started by another client
+ * counts for that one only. A thread reads /proc every STATS_INTERVAL ms,
+ * but only while a menu is open or was until STATS_LINGER ms ago, and the
+ * menu just takes whatever it got last, so drawing never waits for /proc.
+ */
+#define STATS_SLOTS 256
+/* How many stats of counted processes stay open between samples, the rest
+ * are opened every time. Leaves room for everything else under the usual
+ * limit of 1024 files. */
+#define STATS_FDS 256
+/* Gives up on a chain of parents this long, in case pids were reused. */
+#define STATS_DEPTH 64
+
+typedef struct StatSlot {
+	/* Taken by the event thread, given back by the sampler once the
+	 * process is gone or by the event thread once its windows are. */
+	_Atomic pid_t pid;
+	/* What the menu shows: tenths of a percent and kB, -1 if unknown. */
+	atomic_int cpu;
+	atomic_long rss;
+	/* Only for the sampler. */
+	pid_t open;
+	unsigned long long int ticks;
+	long long int when;
+	unsigned long long int sum_ticks;
+	long int sum_rss;
+} StatSlot;
+
+/* Every process the sampler has seen, sorted by pid, with its parent as of
+ * the last time it was read, or -1 if it couldn't be read yet. The ones
+ * counted for a slot may keep their stat open between samples. */
+typedef struct StatProc {
+	pid_t pid;
+	pid_t ppid;
+	int fd;
+} StatProc;
+
+static StatSlot stat_slots[STATS_SLOTS];
+static StatProc *stat_procs;
+static int stat_nprocs;
+static int stat_fds;
+static atomic_llong stats_until;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stats_wake = PTHREAD_COND_INITIALIZER;
+
+void stats_reset(StatSlot *s)
+{
+	s->open = 0;
+	s->when = 0;
+	atomic_store(&s->cpu, -1);
+	atomic_store(&s->rss, -1);
+}
+
+int stats_pid_cmp(const void *a, const void *b)
+{
+	pid_t x = *(const pid_t*) a, y = *(const pid_t*) b;
+	return (x > y) - (x < y);
+}
+
+void stats_close(StatProc *p)
+{
+	if (p->fd < 0)
+		return;
+	close(p->fd);
+	p->fd = -1;
+	stat_fds--;
+}
+
+/* Reads p, through its open stat if it has one, keeping it open if there's
+ * room for one more. */
+int stats_read_proc(StatProc *p, int keep, unsigned long long int *ticks, long int *rss)
+{
+	int fd = p->fd, ok;
+
+	if (fd < 0 && (fd = proc_stat_open(p->pid)) < 0)
+		return 0;
+	ok = proc_stat_read(fd, &p->ppid, ticks, rss);
+	if (p->fd < 0 && ok && keep && stat_fds < STATS_FDS) {
+		p->fd = fd;
+		stat_fds++;
+	} else if (p->fd < 0) {
+		close(fd);
+	}
+	return ok;
+}
+
+/* Brings stat_procs up to date with /proc. New processes, and the ones that
+ * couldn't be read before, are read once for their parent and the ones that
+ * are gone are dropped. */
+void stats_scan(void)
+{
+	static pid_t *pids;
+	static int cap;
+	unsigned long long int ticks;
+	long int rss;
+	struct dirent *d;
+	StatProc *procs;
+	DIR *dir;
+	int n = 0, j = 0;
+
+	if ((dir = opendir("/proc")) == NULL)
+		return;
+	while ((d = readdir(dir)) != NULL) {
+		if (!isdigit((unsigned char) d->d_name[0]))
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 512;
+			pids = realloc(pids, cap * sizeof(pid_t));
+			assert(pids != NULL && "Buy more ram lol");
+		}
+		pids[n++] = atoi(d->d_name);
+	}
+	closedir(dir);
+	qsort(pids, n, sizeof(pid_t), stats_pid_cmp);
+
+	procs = malloc(MAX(n, 1) * sizeof(StatProc));
+	assert(procs != NULL && "Buy more ram lol");
+	for (int k = 0; k < n; k++) {
+		for (; j < stat_nprocs && stat_procs[j].pid < pids[k]; j++)
+			stats_close(&stat_procs[j]);
+		if (j < stat_nprocs && stat_procs[j].pid == pids[k])
+			procs[k] = stat_procs[j++];
+		else
+			procs[k] = (StatProc) { pids[k], -1, -1 };
+		if (procs[k].ppid < 0 && !stats_read_proc(&procs[k], 0, &ticks, &rss))
+			procs[k].ppid = -1;
+	}
+	for (; j < stat_nprocs; j++)
+		stats_close(&stat_procs[j]);
+
+	free(stat_procs);
+	stat_procs = procs;
+	stat_nprocs = n;
+}
+
+/* Samples every slot at once, as finding what a client started means going
+ * through every process anyway. */
+void stats_sample(long long int now)
+{
+	static long int tck, page;
+	/* The pid of every slot in use and the slot, sorted by pid. */
+	struct { pid_t pid; int slot; } owners[STATS_SLOTS], *o;
+	unsigned long long int ticks;
+	long int rss;
+	StatProc *p, *q;
+	StatSlot *s;
+	pid_t pid;
+	int no = 0;
+
+	if (tck == 0) {
+		tck = sysconf(_SC_CLK_TCK);
+		page = sysconf(_SC_PAGESIZE) / 1024;
+	}
+	stats_scan();
+
+	for (int j = 0; j < STATS_SLOTS; j++) {
+		s = &stat_slots[j];
+		if ((pid = atomic_load(&s->pid)) == 0) {
+			if (s->open != 0)
+				stats_reset(s);
+			continue;
+		}
+		p = bsearch(&pid, stat_procs, stat_nprocs, sizeof(StatProc), stats_pid_cmp);
+		if (p == NULL || p->ppid < 0) {
+			stats_reset(s);
+			/* Unless the event thread gave it to someone else meanwhile. */
+			atomic_compare_exchange_strong(&s->pid, &pid, 0);
+			continue;
+		}
+		if (s->open != pid) {
+			stats_reset(s);
+			s->open = pid;
+		}
+		owners[no].pid = pid;
+		owners[no++].slot = j;
+		s->sum_ticks = 0;
+		s->sum_rss = 0;
+	}
+	qsort(owners, no, sizeof(owners[0]), stats_pid_cmp);
+
+	for (int k = 0; k < stat_nprocs; k++) {
+		p = &stat_procs[k];
+		/* Counts for the closest of its ancestors that has a slot. */
+		o = NULL;
+		q = p;
+		for (int depth = 0; q != NULL && q->ppid > 0 && depth < STATS_DEPTH; depth++) {
+			if ((o = bsearch(&q->pid, owners, no, sizeof(owners[0]), stats_pid_cmp)) != NULL)
+				break;
+			q = bsearch(&q->ppid, stat_procs, stat_nprocs, sizeof(StatProc), stats_pid_cmp);
+		}
+		if (o == NULL) {
+			stats_close(p);
+			continue;
+		}
+		if (!stats_read_proc(p, 1, &ticks, &rss)) {
+			p->ppid = -1;
+			continue;
+		}
+		s = &stat_slots[o->slot];
+		s->sum_ticks += ticks;
+		s->sum_rss += rss;
+	}
+
+	for (int j = 0; j < STATS_SLOTS; j++) {
+		s = &stat_slots[j];
+		if (s->open == 0)
+			continue;
+		/* A process that's gone takes its ticks along. */
+		if (s->when != 0 && now > s->when)
+			atomic_store(&s->cpu, s->sum_ticks < s->ticks ? 0
+				: (s->sum_ticks - s->ticks) * 1000 * 1000 / tck / (now - s->when));
+		s->ticks = s->sum_ticks;
+		s->when = now;
+		atomic_store(&s->rss, s->sum_rss * page);
+	}
+}
+
+void *stats_thread(void *_a)
+{
+	struct timespec t;
+	long long int now;
+
+	for (;;) {
+		pthread_mutex_lock(&stats_lock);
+		now = now_ms();
+		if (now >= atomic_load(&stats_until)) {
+			pthread_cond_wait(&stats_wake, &stats_lock);
 		} else {
-			drw_setscheme(i->menu_drw, i->menu_color);
+			clock_gettime(CLOCK_REALTIME, &t);
+			t.tv_nsec += STATS_INTERVAL % 1000 * 1000000L;
+			t.tv_sec += STATS_INTERVAL / 1000 + t.tv_nsec / 1000000000;
+			t.tv_nsec %= 1000000000;
+			pthread_cond_timedwait(&stats_wake, &stats_lock, &t);
+		}
+		pthread_mutex_unlock(&stats_lock);
+
+		now = now_ms();
+		if (now >= atomic_load(&stats_until))
+			continue;
+		stats_sample(now);
+	}
+
+	return NULL;
+}
+
+/* A menu opened or closed: keep sampling for a while. */
+void stats_touch(void)
+{
+	static int started;
+	pthread_t th;
+
+	if (!started) {
+		for (int j = 0; j < STATS_SLOTS; j++)
+			stats_reset(&stat_slots[j]);
+		started = !pthread_create(&th, NULL, stats_thread, NULL);
+		if (started)
+			pthread_detach(th);
+	}
+	atomic_store(&stats_until, now_ms() + STATS_LINGER);
+	pthread_mutex_lock(&stats_lock);
+	pthread_cond_signal(&stats_wake);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* The slot sampling pid, taking a free one if needed. NULL if all are
+ * taken. */
+StatSlot *stats_slot(pid_t pid)
+{
+	StatSlot *empty = NULL;
+	pid_t zero = 0;
+
+	for (int j = 0; j < STATS_SLOTS; j++) {
+		if (atomic_load(&stat_slots[j].pid) == pid)
+			return &stat_slots[j];
+		if (empty == NULL && atomic_load(&stat_slots[j].pid) == 0)
+			empty = &stat_slots[j];
+	}
+	if (empty != NULL && atomic_compare_exchange_strong(&empty->pid, &zero, pid)) {
+		/* It may still say what the last one was using. */
+		atomic_store(&empty->cpu, -1);
+		atomic_store(&empty->rss, -1);
+		return empty;
+	}
+	return NULL;
+}
+
+/* Gives back the slots of processes without windows, as the sampler only
+ * does it once they're gone. */
+void stats_release(Iguassu *i)
+{
+	pid_t pid;
+	int found;
+
+	for (int j = 0; j < STATS_SLOTS; j++) {
+		if ((pid = atomic_load(&stat_slots[j].pid)) == 0)
+			continue;
+		found = 0;
+		for (int d = 0; d < DESKTOPS && !found; d++)
+			for (Container *c = *model_head(&i->m, d); c != NULL && !found; c = c->next)
+				for (Client *cli = c->clients; cli != NULL && !found; cli = cli->next)
+					found = cli->pid == pid;
+		if (!found)
+			atomic_compare_exchange_strong(&stat_slots[j].pid, &pid, 0);
+	}
+}
+
+/* What the stats column says for c: what its clients started, summed. */
+void stats_label(Container *c, char *buf, size_t len)
+{
+	StatSlot *s;
+	Client *o;
+	long int rss = -1;
+	int cpu = -1, v;
+
+	for (Client *cli = c->clients; cli != NULL; cli = cli->next) {
+		if (cli->pid <= 0 || (s = stats_slot(cli->pid)) == NULL)
+			continue;
+		/* Clients of the same process count once. */
+		for (o = c->clients; o != cli && o->pid != cli->pid; o = o->next)
+			;
+		if (o != cli)
+			continue;
+		if ((v = atomic_load(&s->cpu)) >= 0)
+			cpu = MAX(cpu, 0) + v;
+		if (atomic_load(&s->rss) >= 0)
+			rss = MAX(rss, 0) + atomic_load(&s->rss);
+	}
+
+	if (rss < 0)
+		buf[0] = '\0';
+	else if (cpu < 0)
+		snprintf(buf, len, "%ldM", rss / 1024);
+	else
+		snprintf(buf, len, "%d%% %ldM", (cpu + 5) / 10, rss / 1024);
+}
+#endif
+
+/* Loading fonts can take tens of milliseconds, so instead of delaying the
+ * startup, the menus are set up when the event loop is idle for the first
+ * time, or when a menu opens before that. */
+void menu_init(Iguassu *i)
+{
+	if (i->menu_drw != NULL)
+		return;
+	PHASE(i->dpy, "until idle");
+
+	i->menu_drw = drw_create(i->dpy, i->screen, i->root, 10, 10);
+	if (i->menu_drw == NULL
+		|| (i->menu_font = drw_fontset_create(i->menu_drw, font, 1)) == NULL
+		|| (i->menu_color = drw_scm_create(i->menu_drw, menu_color, 2)) == NULL
+		|| (i->menu_color_f = drw_scm_create(i->menu_drw, menu_color_f, 2)) == NULL) {
+		fprintf(stderr, "iguassu: cannot set up the menus\n");
+		exit(1);
+	}
+	drw_setscheme(i->menu_drw, i->menu_color);
+
+	i->menu_win = XCreateSimpleWindow(
+		i->dpy,
+		i->root,
+		0,
+		0,
+		10,
+		10,
+		BORDER_WIDTH,
+		MENU_BORDER_COLOR,
+		MENU_BACKGROUND_COLOR);
+	log_menu(i);
+	PHASE(i->dpy, "menus");
+}
+
+/* Fills the scrollable rows of a menu: every container, or only the hidden
+ * ones. */
+void menu_items(Iguassu *i, Menu *m, int hidden_only)
+{
+	m->nitems = 0;
+	for (Container *c = i->m.containers; c != NULL; c = c->next) {
+		if (hidden_only && !c->hidden)
+			continue;
+		if (m->nitems == m->cap) {
+			m->cap = m->cap ? m->cap * 2 : 32;
+			m->items = realloc(m->items, m->cap * sizeof(Container*));
+			assert(m->items != NULL && "Buy more ram lol");
+		}
+		m->items[m->nitems++] = c;
+	}
+}
+
+/* Fits the menu in the screen, centered in the click if possible. If not all
+ * rows fit, the items are shown between two scroll arrows. */
+int menu_fit(Iguassu *i, Menu *m)
+{
+	int max = (i->sh - 2 * BORDER_WIDTH) / (int) m->h;
+	int rows;
+
+	if (m->nfixed + m->nitems <= max) {
+		m->nvisible = m->nitems;
+		rows = m->nfixed + m->nitems;
+	} else {
+		m->nvisible = MAX(max - m->nfixed - 2, 1);
+		rows = m->nfixed + m->nvisible + 2;
+	}
+	m->top = MAX(MIN(m->top, m->nitems - m->nvisible), 0);
+
+	return rows;
+}
+
+/* The drawing area of the menus only grows, so opening one that fits (or
+ * rendering its cache) doesn't have to make it again. */
+void menu_reserve(Iguassu *i, unsigned int w, unsigned int h)
+{
+	Drw *d = i->menu_drw;
+
+	if (w > d->w || h > d->h)
+		drw_resize(d, MAX(w, d->w), MAX(h, d->h));
+}
+
+void menu_layout(Iguassu *i, Menu *m)
+{
+	int rows = menu_fit(i, m);
+	int x, y;
+
+	if (rows == m->rows)
+		return;
+	m->rows = rows;
+
+	x = m->cx - (int) m->w / 2;
+	x = MAX(MIN(x, i->sw - (int) m->w - 2 * BORDER_WIDTH), 0);
+	y = MAX(MIN(m->cy, i->sh - rows * (int) m->h - 2 * BORDER_WIDTH), 0);
+	m->x = x;
+	m->y = y;
+
+	XMoveResizeWindow(i->dpy, i->menu_win, x, y, m->w, m->h * rows);
+	menu_reserve(i, m->w, m->h * rows);
+}
+
+int menu_overflows(Menu *m)
+{
+	return m->nvisible < m->nitems;
+}
+
+/* What is at the nth row of the window: a fixed row, an item (numbered after
+ * the fixed rows), MENU_UP, MENU_DOWN or -1 for nothing. */
+int menu_slot(Menu *m, int n)
+{
+	if (n < 0 || n >= m->rows)
+		return -1;
+	if (n < m->nfixed)
+		return n;
+	if (!menu_overflows(m))
+		return n;
+	if (n == m->nfixed)
+		return MENU_UP;
+	if (n == m->rows - 1)
+		return MENU_DOWN;
+	return m->nfixed + m->top + n - m->nfixed - 1;
+}
+
+int menu_at(Menu *m, int x, int y)
+{
+	if (x < 0 || y < 0 || x >= (int) m->w)
+		return -1;
+	return menu_slot(m, y / (int) m->h);
+}
+
+void menu_scroll(Menu *m, int d)
+{
+	m->top = MAX(MIN(m->top + d, m->nitems - m->nvisible), 0);
+}
+
+/* Draws the nth row of the window, without showing it. */
+void draw_row(Iguassu *i, Menu *m, int n, int sel)
+{
+	const char *label;
+	Container *c;
+	int row = menu_slot(m, n);
+
+	if (row == MENU_UP)
+		label = m->top > 0 ? "\xe2\x96\xb2" : "";
+	else if (row == MENU_DOWN)
+		label = m->top + m->nvisible < m->nitems ? "\xe2\x96\xbc" : "";
+	else if (row < m->nfixed)
+		label = m->fixed[row];
+	else if ((c = m->items[row - m->nfixed])->clients != NULL && c->clients->name != NULL)
+		label = c->clients->name;
+	else
+		label = "";
+
+	drw_setscheme(i->menu_drw, row >= 0 && row == sel ? i->menu_color_f : i->menu_color);
+	drw_text(i->menu_drw, 0, m->h * n, m->w - m->stats, m->h, 0, label, 0);
+#ifdef MENU_STATS
+	if (m->stats) {
+		char buf[32] = "";
+		if (row >= m->nfixed)
+			stats_label(m->items[row - m->nfixed], buf, sizeof(buf));
+		drw_text(i->menu_drw, m->w - m->stats, m->h * n, m->stats, m->h,
+			m->stats - MIN(m->stats, drw_fontset_getwidth(i->menu_drw, buf)), buf, 0);
+	}
+#endif
+}
+
+/* Only the rows on the screen are drawn, so it costs the same with any number
+ * of windows. */
+void draw_menu(Iguassu *i, Menu *m, int sel)
+{
+	TRACE_BEGIN(t);
+
+	for (int n = 0; n < m->rows; n++)
+		draw_row(i, m, n, sel);
+
+	drw_map(i->menu_drw, i->menu_win, 0, 0, m->w, m->h * m->rows);
+	TRACE_END(t, "draw_menu");
+}
+
+/* Redraws the row showing item (if it's on the screen) and only that. */
+void draw_item(Iguassu *i, Menu *m, int item, int sel)
+{
+	for (int n = 0; item >= 0 && n < m->rows; n++) {
+		if (menu_slot(m, n) == item) {
+			draw_row(i, m, n, sel);
+			drw_map(i->menu_drw, i->menu_win, 0, m->h * n, m->w, m->h);
 		}
-		drw_text(i->menu_drw, 0, h * j, w, h, 0, main_menu_items[j], 0);
 	}
+}
 
-	for (Container *c = i->containers; c != NULL; c = c->next) {
-		if (c->hidden) {
-			if (in_menu && cur_x >= h * j && cur_x < h * (j + 1)) {
-				drw_setscheme(i->menu_drw, i->menu_color_f);
-				r = j;
-			} else {
-				drw_setscheme(i->menu_drw, i->menu_color);
-			}
-
-			if (c->clients != NULL && c->clients->name != NULL)
-				drw_text(i->menu_drw, 0, h * j, w, h, 0, c->clients->name, 0);
+/* Renders the menus that are out of date. Only while idle, as it's the same
+ * work as opening them. */
+void menu_prerender(Iguassu *i)
+{
+	TRACE_BEGIN(t);
+	MenuCache *mc;
+	Menu m;
+
+	for (int k = 0; k < 2; k++) {
+		mc = &i->menu_cache[k];
+		if (mc->gen == i->m.gen)
+			continue;
+#ifdef MENU_STATS
+		/* Its numbers change all the time, so it's always drawn as it
+		 * opens. */
+		if (!k) {
+			mc->gen = i->m.gen;
+			continue;
+		}
+#endif
 
-			j++;
+		memset(&m, 0, sizeof(m));
+		if (k) {
+			m.fixed = main_menu_items;
+			m.nfixed = 5;
 		}
+		drw_font_getexts(i->menu_font, MENU_LENGTH, sizeof(MENU_LENGTH), &m.w, &m.h);
+		menu_items(i, &m, k);
+		m.rows = menu_fit(i, &m);
+
+		if (mc->pix == None || mc->w != m.w || mc->h != m.h * m.rows) {
+			if (mc->pix != None)
+				XFreePixmap(i->dpy, mc->pix);
+			mc->w = m.w;
+			mc->h = m.h * m.rows;
+			mc->pix = mc->h > 0 ? XCreatePixmap(i->dpy, i->root, mc->w, mc->h,
+				DefaultDepth(i->dpy, i->screen)) : None;
+		}
+		if (mc->pix != None) {
+			menu_reserve(i, m.w, mc->h);
+			for (int n = 0; n < m.rows; n++)
+				draw_row(i, &m, n, -1);
+			drw_map(i->menu_drw, mc->pix, 0, 0, m.w, mc->h);
+		}
+		mc->rows = m.rows;
+		mc->gen = i->m.gen;
+		free(m.items);
 	}
+	TRACE_END(t, "menu_prerender");
+}
 
-	drw_map(i->menu_drw, i->menu_win, 0, 0, w, h * (5 + n_hid));
-
-	return r;
+int menu_stale(Iguassu *i)
+{
+	return i->menu_drw != NULL
+		&& (i->menu_cache[0].gen != i->m.gen || i->menu_cache[1].gen != i->m.gen);
 }
 
-int draw_container_menu(Iguassu *i, int x, int y, int cur_x, int cur_y, int w, int h, int nc)
+/* Shows the menu from its cache if it's up to date, with only the selected
+ * row drawn on top. */
+int draw_menu_cached(Iguassu *i, Menu *m, int hidden_only, int sel)
 {
-	int j, in_menu;
-	int r = -1;
+	MenuCache *mc = &i->menu_cache[hidden_only];
 
-	drw_rect(i->menu_drw, 0, 0, w, h * nc, 1, 0);
+	if (m->stats || m->top != 0 || mc->pix == None || mc->gen != i->m.gen
+		|| mc->rows != m->rows || mc->w != m->w)
+		return 0;
 
-	in_menu = cur_x >= 0 && cur_y >= 0 && cur_x <= h * nc && cur_y <= w;
-	j = 0;
-	for (Container *c = i->containers; c != NULL; c = c->next) {
-		if (in_menu && cur_x >= h * j && cur_x < h * (j + 1)) {
-			drw_setscheme(i->menu_drw, i->menu_color_f);
-			r = j;
-		} else {
-			drw_setscheme(i->menu_drw, i->menu_color);
-		}
+	XCopyArea(i->dpy, mc->pix, i->menu_win, i->menu_drw->gc, 0, 0, mc->w, mc->h, 0, 0);
+	draw_item(i, m, sel, sel);
+	return 1;
+}
 
-		if (c->clients != NULL && c->clients->name != NULL)
-			drw_text(i->menu_drw, 0, h * j, w, h, 0, c->clients->name, 0);
+#ifdef THUMBNAILS
+/* Shows the picture of the selected hidden window next to its row. */
+void thumb_preview(Iguassu *i, Menu *m, int sel)
+{
+	Thumb *t = NULL;
+	int n, x, y;
 
-		j++;
+	if (!i->composite)
+		return;
+	for (n = 0; n < m->rows && menu_slot(m, n) != sel; n++)
+		;
+	if (sel >= m->nfixed && n < m->rows)
+		t = thumb_find(i, m->items[sel - m->nfixed]->clients->id);
+	if (t == NULL || t->pix == None) {
+		XUnmapWindow(i->dpy, i->thumb_win);
+		return;
 	}
-
-	drw_map(i->menu_drw, i->menu_win, 0, 0, w, h * nc);
-
-	return r;
+	t->used = now_ms();
+
+	x = m->x + (int) m->w + 2 * BORDER_WIDTH;
+	if (x + THUMB_WIDTH + 2 * BORDER_WIDTH > i->sw)
+		x = m->x - THUMB_WIDTH - 2 * BORDER_WIDTH;
+	y = MAX(MIN(m->y + n * (int) m->h, i->sh - THUMB_HEIGHT - 2 * BORDER_WIDTH), 0);
+	XMoveWindow(i->dpy, i->thumb_win, x, y);
+	XSetWindowBackgroundPixmap(i->dpy, i->thumb_win, t->pix);
+	XClearWindow(i->dpy, i->thumb_win);
+	XMapRaised(i->dpy, i->thumb_win);
 }
+#endif
 
-void main_menu(Iguassu *i, int x, int y)
+/* Runs the menu until a button is pressed or released and returns the
+ * selected row, or -1. Hovering the arrows or using the wheel scrolls. */
+int run_menu(Iguassu *i, Menu *m, int hidden_only)
 {
-	unsigned int w, h;
-	int sel, pid, win, n_hid;
-	Container *c;
 	XEvent ev;
-
-	n_hid = n_hidden(i);
+	int px, py, hit, old_sel, old_top;
+	int sel, scroll = 0, timeout, redraw;
+	unsigned int gen = i->m.gen;
+
+	drw_font_getexts(i->menu_font, MENU_LENGTH, sizeof(MENU_LENGTH), &m->w, &m->h);
+	m->w += m->stats;
+	menu_items(i, m, hidden_only);
+	menu_layout(i, m);
 	XMapRaised(i->dpy, i->menu_win);
 
-	drw_font_getexts(i->menu_font, MENU_LENGTH, sizeof(MENU_LENGTH), &w, &h);
-
-	x = x - (w / 2);
-	XMoveResizeWindow(i->dpy, i->menu_win, x, y, w, h * (5 + n_hid));
-	drw_resize(i->menu_drw, w, h * (5 + n_hid));
-	sel = draw_main_menu(i, x, y, x, y, w, h, n_hid);
+	/* The menu opens with the pointer on it. */
+	px = m->cx - m->x;
+	py = m->cy - m->y;
+	sel = menu_at(m, px, py);
+	if (!draw_menu_cached(i, m, hidden_only, sel))
+		draw_menu(i, m, sel);
+#ifdef THUMBNAILS
+	if (hidden_only)
+		thumb_preview(i, m, sel);
+#endif
 
 	XGrabPointer(i->dpy,
 		i->menu_win,
@@ -825,46 +3561,105 @@ void main_menu(Iguassu *i, int x, int y)
 		CurrentTime);
 
 	for (int exit = 0; !exit;) {
-		XSync(i->dpy, False);
-		XNextEvent(i->dpy, &ev);
+		old_sel = sel;
+		old_top = m->top;
+		redraw = 0;
+
+		/* With stats, it's redrawn every now and then with the new
+		 * numbers. */
+		timeout = scroll ? MENU_SCROLL_DELAY : -1;
+#ifdef MENU_STATS
+		if (!scroll && m->stats)
+			timeout = STATS_INTERVAL;
+#endif
+		if (!next_event(i, &ev, timeout)) {
+			menu_scroll(m, scroll);
+			if (m->top != old_top || m->stats)
+				draw_menu(i, m, sel);
+			continue;
+		}
 
 		switch (ev.type) {
 		case ButtonPress:
 		case ButtonRelease:
+			if (ev.xbutton.button == Button4 || ev.xbutton.button == Button5) {
+				if (ev.type == ButtonPress)
+					menu_scroll(m, ev.xbutton.button == Button4 ? -1 : 1);
+				break;
+			}
 			exit = 1;
 			break;
 		case MotionNotify:
-			n_hid = n_hidden(i);
-			sel = draw_main_menu(
-				i,
-				x,
-				y,
-				ev.xmotion.y,
-				ev.xmotion.x,
-				w,
-				h,
-				n_hid);
+			px = ev.xmotion.x;
+			py = ev.xmotion.y;
 			break;
 		default:
 			handle_event(i, &ev);
+			/* Containers may be gone now, or have new names. Most
+			 * events change nothing the menu shows. */
+			if (i->m.gen != gen) {
+				gen = i->m.gen;
+				menu_items(i, m, hidden_only);
+				menu_layout(i, m);
+				redraw = 1;
+				if (m->nfixed + m->nitems < 1)
+					exit = 1;
+			}
+		}
+
+		hit = menu_at(m, px, py);
+		scroll = hit == MENU_UP ? -1 : hit == MENU_DOWN ? 1 : 0;
+		sel = hit >= 0 ? hit : -1;
+		if (!exit && (redraw || sel != old_sel || m->top != old_top)) {
+			if (redraw || m->top != old_top) {
+				draw_menu(i, m, sel);
+			} else {
+				/* Just the row that lost the selection and the one
+				 * that got it. */
+				draw_item(i, m, old_sel, sel);
+				draw_item(i, m, sel, sel);
+			}
+#ifdef THUMBNAILS
+			if (hidden_only)
+				thumb_preview(i, m, sel);
+#endif
 		}
 	}
 
+#ifdef THUMBNAILS
+	if (i->composite)
+		XUnmapWindow(i->dpy, i->thumb_win);
+#endif
 	XUnmapWindow(i->dpy, i->menu_win);
 	XUngrabPointer(i->dpy, CurrentTime);
 
+	if (m->nfixed + m->nitems < 1)
+		return -1;
+	return sel;
+}
+
+void main_menu(Iguassu *i, int x, int y)
+{
+	int sel, win, px, py;
+	Container *c;
+	Menu m = {0};
+
+	menu_init(i);
+	m.cx = x;
+	m.cy = y;
+	m.fixed = main_menu_items;
+	m.nfixed = 5;
+	sel = run_menu(i, &m, 1);
+	free(m.items);
+
 	switch (sel) {
 	case MENU_NEW:
-		pid = fork();
-		assert(pid != -1 && "wtf cannot fork lol");
-		if (pid == 0) {
-			execlp(TERMINAL, TERMINAL, NULL);
-			exit(1);
-		}
-		new_container(i, None, NULL, pid, 0, 1);
+		if (i->log.play != NULL || pool_take(i))
+			break;
+		pending_add(i, spawn_terminal());
 		break;
 	case MENU_RESHAPE:
-		win = select_win(i);
+		win = select_win(i, NULL, NULL);
 		if (win != None) {
 			if ((c = find_container(i, win)) != NULL) {
 				reshape_container(i, c);
@@ -873,20 +3668,20 @@ void main_menu(Iguassu *i, int x, int y)
 		}
 		break;
 	case MENU_MOVE:
-		win = select_win(i);
+		win = select_win(i, &px, &py);
 		if (win != None)
 			if ((c = find_container(i, win)) != NULL)
-				move_container(i, c);
+				move_container(i, c, px, py);
 		break;
 	case MENU_DELETE:
-		win = select_win(i);
+		win = select_win(i, NULL, NULL);
 		if (win != None)
 			if ((c = find_container(i, win)) != NULL)
 				for (Client *cli = c->clients; cli != NULL; cli = cli->next)
 					XKillClient(i->dpy, cli->id);
 		break;
 	case MENU_HIDE:
-		win = select_win(i);
+		win = select_win(i, NULL, NULL);
 		if (win != None)
 			hide(i, win);
 		break;
@@ -900,68 +3695,220 @@ void main_menu(Iguassu *i, int x, int y)
 
 void container_menu(Iguassu *i, int x, int y)
 {
-	int sel, nc;
+	int sel;
+	Menu m = {0};
+
+	if (i->m.containers == NULL)
+		return;
+
+	menu_init(i);
+	m.cx = x;
+	m.cy = y;
+#ifdef MENU_STATS
+	/* So the sampler starts on them before the menu is drawn. */
+	stats_release(i);
+	for (Container *c = i->m.containers; c != NULL; c = c->next)
+		for (Client *cli = c->clients; cli != NULL; cli = cli->next)
+			if (cli->pid > 0)
+				stats_slot(cli->pid);
+	m.stats = drw_fontset_getwidth(i->menu_drw, "9999% 99999M");
+	stats_touch();
+#endif
+	sel = run_menu(i, &m, 0);
+	free(m.items);
+#ifdef MENU_STATS
+	stats_touch();
+#endif
+
+	if (sel > -1)
+		focus_by_idx(i, sel);
+}
+
+/* Case insensitive strstr, but for the first len bytes of term. */
+int title_has(const char *name, const char *term, int len)
+{
+	for (; *name; name++)
+		if (!strncasecmp(name, term, len))
+			return 1;
+	return 0;
+}
+
+/* A title matches when it has every space separated term of q. */
+int title_matches(const char *name, const char *q)
+{
+	int len;
+
+	for (;;) {
+		while (*q == ' ')
+			q++;
+		if (!*q)
+			return 1;
+		for (len = 0; q[len] && q[len] != ' '; len++)
+			;
+		if (name == NULL || !title_has(name, q, len))
+			return 0;
+		q += len;
+	}
+}
+
+/* Finds the containers with a client matching q, in MRU order. The first max
+ * ones go to res and the total is returned. */
+int switcher_filter(Iguassu *i, const char *q, Container **res, int max)
+{
+	TriBucket *b, *best = NULL;
+	Client *cli;
+	int n = 0;
+
+	/* Every match is in the bucket of every trigram of the query, so only
+	 * the smallest one needs to be checked. */
+	for (const char *s = q; s[0] && s[1] && s[2]; s++) {
+		if (s[0] == ' ' || s[1] == ' ' || s[2] == ' ')
+			continue;
+		b = &i->m.tri[model_tri_hash(s) % TRI_BUCKETS];
+		if (best == NULL || b->n < best->n)
+			best = b;
+	}
+
+	i->m.tri_epoch++;
+	if (best != NULL)
+		for (int j = 0; j < best->n; j++)
+			if (title_matches(best->clients[j]->name, q))
+				best->clients[j]->match = i->m.tri_epoch;
+
+	for (Container *c = i->m.containers; c != NULL; c = c->next) {
+		for (cli = c->clients; cli != NULL; cli = cli->next) {
+			if (best != NULL && cli->match == i->m.tri_epoch)
+				break;
+			if (best == NULL && title_matches(cli->name, q))
+				break;
+		}
+		if (cli == NULL)
+			continue;
+
+		if (n < max)
+			res[n] = c;
+		n++;
+	}
+
+	return n;
+}
+
+void draw_switcher(Iguassu *i, const char *q, Container **res, int n, int total, int sel, int w, int h)
+{
+	TRACE_BEGIN(t);
+	char buf[sizeof("9999999999> ") + 256];
+	const char *name;
+
+	drw_setscheme(i->menu_drw, i->menu_color);
+	snprintf(buf, sizeof(buf), "%d> %s", total, q);
+	drw_text(i->menu_drw, 0, 0, w, h, 0, buf, 0);
+
+	for (int j = 0; j < SWITCHER_ROWS; j++) {
+		name = j < n ? res[j]->clients->name : NULL;
+		drw_setscheme(i->menu_drw, j == sel ? i->menu_color_f : i->menu_color);
+		drw_text(i->menu_drw, 0, h * (j + 1), w, h, 0, name != NULL ? name : "", 0);
+	}
+
+	drw_map(i->menu_drw, i->menu_win, 0, 0, w, h * (SWITCHER_ROWS + 1));
+	TRACE_END(t, "draw_switcher");
+}
+
+/* Keyboard window switcher. Lists the containers in the order they were
+ * focused and filters them by title as you type. */
+void switcher(Iguassu *i)
+{
+	Container *res[SWITCHER_ROWS];
+	char q[256] = "";
+	char buf[32];
+	int x, y, n, total, sel, nb;
+	int len = 0;
 	unsigned int w, h;
+	KeySym ks;
 	XEvent ev;
 
-	nc = n_cont(i);
-	if (nc < 1)
+	total = switcher_filter(i, q, res, SWITCHER_ROWS);
+	if (total < 1)
 		return;
+	menu_init(i);
+	n = MIN(total, SWITCHER_ROWS);
+	/* Like alt-tab, so a single keystroke goes back to the last window. */
+	sel = n > 1 ? 1 : 0;
 
-	XMapRaised(i->dpy, i->menu_win);
-
-	/* This keeps our menu consistent. */
-	drw_font_getexts(i->menu_font, MENU_LENGTH, sizeof(MENU_LENGTH), &w, &h);
+	drw_font_getexts(i->menu_font, SWITCHER_LENGTH, sizeof(SWITCHER_LENGTH), &w, &h);
 
-	x = x - (w / 2);
-	XMoveResizeWindow(i->dpy, i->menu_win, x, y, w, h * nc);
-	drw_resize(i->menu_drw, w, h * nc);
-	sel = draw_container_menu(i, x, y, x, y, w, h, nc);
+	x = (i->sw - w) / 2;
+	y = (i->sh - h * (SWITCHER_ROWS + 1)) / 2;
+	XMoveResizeWindow(i->dpy, i->menu_win, x, y, w, h * (SWITCHER_ROWS + 1));
+	XMapRaised(i->dpy, i->menu_win);
+	menu_reserve(i, w, h * (SWITCHER_ROWS + 1));
+	draw_switcher(i, q, res, n, total, sel, w, h);
 
-	XGrabPointer(i->dpy,
-		i->menu_win,
-		False,
-		PointerMotionMask | ButtonPressMask | ButtonReleaseMask,
-		GrabModeAsync,
-		GrabModeAsync,
-		None,
-		i->cursors.left_ptr,
-		CurrentTime);
+	XGrabKeyboard(i->dpy, i->root, True, GrabModeAsync, GrabModeAsync, CurrentTime);
 
 	for (int exit = 0; !exit;) {
-		XSync(i->dpy, False);
-		XNextEvent(i->dpy, &ev);
+		next_event(i, &ev, -1);
 
-		switch (ev.type) {
-		case ButtonPress:
-		case ButtonRelease:
+		if (ev.type != KeyPress) {
+			handle_event(i, &ev);
+			/* Containers may be gone now. */
+			total = switcher_filter(i, q, res, SWITCHER_ROWS);
+			n = MIN(total, SWITCHER_ROWS);
+			if (sel >= n)
+				sel = 0;
+			draw_switcher(i, q, res, n, total, sel, w, h);
+			continue;
+		}
+
+		nb = XLookupString(&ev.xkey, buf, sizeof(buf), &ks, NULL);
+		switch (ks) {
+		case XK_Escape:
+			sel = -1;
 			exit = 1;
 			break;
-		case MotionNotify:
-			nc = n_cont(i);
-			if (nc < 1)
-				goto clean;
-			sel = draw_container_menu(
-				i,
-				x,
-				y,
-				ev.xmotion.y,
-				ev.xmotion.x,
-				w,
-				h,
-				nc);
+		case XK_Return:
+		case XK_KP_Enter:
+			exit = 1;
+			break;
+		case XK_Tab:
+		case XK_Down:
+			if (n > 0)
+				sel = (sel + 1) % n;
+			break;
+		case XK_ISO_Left_Tab:
+		case XK_Up:
+			if (n > 0)
+				sel = (sel + n - 1) % n;
+			break;
+		case XK_BackSpace:
+			if (len == 0)
+				break;
+			/* Remove a whole UTF-8 character. */
+			while (len > 0 && (q[--len] & 0xc0) == 0x80)
+				;
+			q[len] = '\0';
+			total = switcher_filter(i, q, res, SWITCHER_ROWS);
+			n = MIN(total, SWITCHER_ROWS);
+			sel = 0;
 			break;
 		default:
-			handle_event(i, &ev);
+			if (nb < 1 || iscntrl((unsigned char) buf[0]) || len + nb >= sizeof(q))
+				break;
+			memcpy(q + len, buf, nb);
+			len += nb;
+			q[len] = '\0';
+			total = switcher_filter(i, q, res, SWITCHER_ROWS);
+			n = MIN(total, SWITCHER_ROWS);
+			sel = 0;
 		}
+
+		draw_switcher(i, q, res, n, total, sel, w, h);
 	}
 
-clean:
+	XUngrabKeyboard(i->dpy, CurrentTime);
 	XUnmapWindow(i->dpy, i->menu_win);
-	XUngrabPointer(i->dpy, CurrentTime);
 
-	if (sel > -1)
-		focus_by_idx(i, sel);
+	if (sel >= 0 && sel < n)
+		focus_container(i, res[sel]);
 }
 
 void button_press(Iguassu *i, XEvent *e)
@@ -975,8 +3922,198 @@ void button_press(Iguassu *i, XEvent *e)
 			container_menu(i, ev.x_root, ev.y_root);
 	} else {
 		focus_window(i, ev.window);
+		/* Our grab is already gone from the window, so replaying sends the
+		 * click to it. */
+#ifdef CLICK_THROUGH
+		XAllowEvents(i->dpy, ReplayPointer, ev.time);
+#else
+		XAllowEvents(i->dpy, AsyncPointer, ev.time);
+#endif
+	}
+}
+
+#ifdef OVERVIEW
+int tile_cmp(const void *a, const void *b)
+{
+	Damage da = (*(Tile**) a)->damage;
+	Damage db = (*(Tile**) b)->damage;
+	return (da > db) - (da < db);
+}
+
+/* Lays the tiles in a grid with about as many columns as rows, each keeping
+ * the proportions of its window, and sets up their pictures. The geometries
+ * are asked all at once, so it's a single round trip for any number of
+ * windows. */
+void overview_tiles(Iguassu *i, Tile *tiles, int n, int cols, int cw, int ch)
+{
+	xcb_get_geometry_cookie_t *cookies = malloc(n * sizeof(xcb_get_geometry_cookie_t));
+	xcb_get_geometry_reply_t *g;
+	XRenderPictFormat *fmt;
+	XRenderPictureAttributes pa = { 0 };
+	XTransform xf;
+	Tile *t;
+	int w, h;
+	double scale;
+
+	assert(cookies != NULL && "Buy more ram lol");
+	for (int k = 0; k < n; k++)
+		cookies[k] = xcb_get_geometry(i->xcb_con, tiles[k].win);
+
+	for (int k = 0; k < n; k++) {
+		t = &tiles[k];
+		if ((g = xcb_get_geometry_reply(i->xcb_con, cookies[k], NULL)) == NULL)
+			continue;
+		w = g->width + 2 * g->border_width;
+		h = g->height + 2 * g->border_width;
+		fmt = XRenderFindStandardFormat(i->dpy,
+			g->depth == 32 ? PictStandardARGB32 : PictStandardRGB24);
+		free(g);
+
+		/* Never bigger than the window itself. */
+		scale = MAX((double) w / MAX(cw - 2 * OVERVIEW_GAP, 1),
+			(double) h / MAX(ch - 2 * OVERVIEW_GAP, 1));
+		scale = MAX(scale, 1.0);
+		t->w = MAX(w / scale, 1);
+		t->h = MAX(h / scale, 1);
+		t->x = k % cols * cw + (cw - t->w) / 2;
+		t->y = k / cols * ch + (ch - t->h) / 2;
+
+		t->pix = XCompositeNameWindowPixmap(i->dpy, t->win);
+		t->pic = XRenderCreatePicture(i->dpy, t->pix, fmt, 0, &pa);
+		xf = (XTransform) {{
+			{ XDoubleToFixed(scale), 0, 0 },
+			{ 0, XDoubleToFixed(scale), 0 },
+			{ 0, 0, XDoubleToFixed(1) },
+		}};
+		XRenderSetPictureTransform(i->dpy, t->pic, &xf);
+		XRenderSetPictureFilter(i->dpy, t->pic, FilterBilinear, NULL, 0);
+		t->damage = XDamageCreate(i->dpy, t->win, XDamageReportNonEmpty);
+		t->dirty = 1;
+	}
+	free(cookies);
+}
+
+/* Every window of the desktop scaled down, live. Clicking one focuses it,
+ * anything else leaves. The server does the scaling, we only say what goes
+ * where and when. */
+void overview(Iguassu *i)
+{
+	XEvent ev;
+	XRenderPictureAttributes pa = { 0 };
+	Picture dst;
+	Tile *tiles, **by_damage, key, *kp = &key, **hit;
+	Container *sel = NULL;
+	int n = 0, k = 0, cols, rows, cw, ch, col, row;
+
+	if (!i->composite)
+		return;
+	for (Container *c = i->m.containers; c != NULL; c = c->next)
+		if (!c->hidden || KEEP_MAPPED_FLAG)
+			n++;
+	if (n == 0)
+		return;
+
+	tiles = calloc(n, sizeof(Tile));
+	by_damage = malloc(n * sizeof(Tile*));
+	assert(tiles != NULL && by_damage != NULL && "Buy more ram lol");
+	for (Container *c = i->m.containers; c != NULL; c = c->next)
+		if (!c->hidden || KEEP_MAPPED_FLAG)
+			tiles[k++].win = c->clients->id;
+
+	for (cols = 1; cols * cols < n; cols++)
+		;
+	rows = (n + cols - 1) / cols;
+	cw = i->sw / cols;
+	ch = i->sh / rows;
+	overview_tiles(i, tiles, n, cols, cw, ch);
+
+	/* To find the tile of a damage event quickly with hundreds of them. */
+	for (k = 0; k < n; k++)
+		by_damage[k] = &tiles[k];
+	qsort(by_damage, n, sizeof(Tile*), tile_cmp);
+
+	if (i->ov_win == None) {
+		i->ov_win = XCreateSimpleWindow(i->dpy, i->root, 0, 0, i->sw, i->sh,
+			0, OVERVIEW_BACKGROUND, OVERVIEW_BACKGROUND);
+		XSelectInput(i->dpy, i->ov_win, ExposureMask);
+	}
+	dst = XRenderCreatePicture(i->dpy, i->ov_win,
+		XRenderFindVisualFormat(i->dpy, DefaultVisual(i->dpy, i->screen)), 0, &pa);
+	XMapRaised(i->dpy, i->ov_win);
+	XGrabPointer(i->dpy, i->ov_win, False, ButtonPressMask, GrabModeAsync,
+		GrabModeAsync, None, i->cursors.left_ptr, CurrentTime);
+	XGrabKeyboard(i->dpy, i->ov_win, True, GrabModeAsync, GrabModeAsync, CurrentTime);
+
+	for (int exit = 0; !exit;) {
+		/* What changed is drawn once the queue is empty, so a window
+		 * drawing like crazy costs one composite per round, not one per
+		 * damage. */
+		if (!XPending(i->dpy)) {
+			for (k = 0; k < n; k++) {
+				if (!tiles[k].dirty || tiles[k].pic == None)
+					continue;
+				XDamageSubtract(i->dpy, tiles[k].damage, None, None);
+				XRenderComposite(i->dpy, PictOpSrc, tiles[k].pic, None, dst,
+					0, 0, 0, 0, tiles[k].x, tiles[k].y, tiles[k].w, tiles[k].h);
+				tiles[k].dirty = 0;
+			}
+		}
+		next_event(i, &ev, -1);
+
+		if (ev.type == i->damage_event + XDamageNotify) {
+			key.damage = ((XDamageNotifyEvent*) &ev)->damage;
+			hit = bsearch(&kp, by_damage, n, sizeof(Tile*), tile_cmp);
+			if (hit != NULL)
+				(*hit)->dirty = 1;
+			else
+				handle_event(i, &ev);
+			continue;
+		}
+
+		switch (ev.type) {
+		case Expose:
+			if (ev.xexpose.window != i->ov_win) {
+				handle_event(i, &ev);
+				break;
+			}
+			for (k = 0; k < n; k++)
+				tiles[k].dirty = 1;
+			break;
+		case ButtonPress:
+			col = ev.xbutton.x / cw;
+			row = ev.xbutton.y / ch;
+			k = row * cols + col;
+			if (col < cols && k < n)
+				sel = find_container(i, tiles[k].win);
+			exit = 1;
+			break;
+		case KeyPress:
+			exit = 1;
+			break;
+		default:
+			handle_event(i, &ev);
+		}
 	}
+
+	XUngrabKeyboard(i->dpy, CurrentTime);
+	XUngrabPointer(i->dpy, CurrentTime);
+	XUnmapWindow(i->dpy, i->ov_win);
+	for (k = 0; k < n; k++) {
+		if (tiles[k].pic == None)
+			continue;
+		XDamageDestroy(i->dpy, tiles[k].damage);
+		XRenderFreePicture(i->dpy, tiles[k].pic);
+		XFreePixmap(i->dpy, tiles[k].pix);
+	}
+	XRenderFreePicture(i->dpy, dst);
+	free(by_damage);
+	free(tiles);
+
+	/* It may be gone by now. */
+	if (sel != NULL)
+		focus_container(i, sel);
 }
+#endif
 
 void key_press(Iguassu *i, XEvent *e)
 {
@@ -993,32 +4130,149 @@ void key_press(Iguassu *i, XEvent *e)
 		} else if (i->akey == ev->keycode) {
 			if ((c = get_current(i)) != NULL)
 				redraw_client(i, c->clients);
+		} else if (i->skey == ev->keycode) {
+			switcher(i);
+		} else if (i->qkey == ev->keycode) {
+			restart(i);
+#ifdef OVERVIEW
+		} else if (i->okey == ev->keycode) {
+			overview(i);
+#endif
+		} else {
+			for (int d = 0; d < DESKTOPS; d++)
+				if (i->dkeys[d] == ev->keycode)
+					switch_desktop(i, d);
 		}
+	} else if (ev->state == (MODMASK | ShiftMask)) {
+		for (int d = 0; d < DESKTOPS; d++)
+			if (i->dkeys[d] == ev->keycode)
+				send_to_desktop(i, get_current(i), d);
+	}
+}
+
+typedef struct Coalesce {
+	Window win;
+	/* Seen something after which the window isn't the same anymore. */
+	int stop;
+} Coalesce;
+
+/* Xlib calls it on the queue in order, so once a map, unmap or destroy of the
+ * window shows up nothing behind it is taken. */
+Bool same_configure_request(Display *dpy, XEvent *ev, XPointer arg)
+{
+	Coalesce *co = (Coalesce*) arg;
+	(void) dpy;
+
+	if (co->stop)
+		return False;
+	if ((ev->type == MapRequest && ev->xmaprequest.window == co->win)
+		|| (ev->type == UnmapNotify && ev->xunmap.window == co->win)
+		|| (ev->type == DestroyNotify && ev->xdestroywindow.window == co->win)) {
+		co->stop = 1;
+		return False;
+	}
+	return ev->type == ConfigureRequest
+		&& ev->xconfigurerequest.window == co->win;
+}
+
+/* Folds every ConfigureRequest for the same window that's already queued into
+ * e, so a client resizing like crazy gets a single configure. Later values win.
+ * Requests after the window is mapped, unmapped or destroyed are left alone,
+ * as they're for what it is then. Returns how many requests were merged. */
+int coalesce_configure_requests(Iguassu *i, XConfigureRequestEvent *e)
+{
+	int n = 0;
+	XEvent next;
+	XConfigureRequestEvent *ne = &next.xconfigurerequest;
+	Coalesce co = { e->window, 0 };
+
+	while (XCheckIfEvent(i->dpy, &next, same_configure_request, (XPointer) &co)) {
+		log_event(i, &next);
+		if (ne->value_mask & CWX)
+			e->x = ne->x;
+		if (ne->value_mask & CWY)
+			e->y = ne->y;
+		if (ne->value_mask & CWWidth)
+			e->width = ne->width;
+		if (ne->value_mask & CWHeight)
+			e->height = ne->height;
+		if (ne->value_mask & CWBorderWidth)
+			e->border_width = ne->border_width;
+		if (ne->value_mask & CWSibling)
+			e->above = ne->above;
+		if (ne->value_mask & CWStackMode)
+			e->detail = ne->detail;
+		e->value_mask |= ne->value_mask;
+		n++;
 	}
+
+	return n;
 }
 
 void configure_request(Iguassu *i, XEvent *ev)
 {
-	Window _dumb;
-	int x, y;
-	unsigned int w, h, _dumbi;
+	int merged;
+	unsigned int mask;
+	XWindowChanges wc;
 	XConfigureRequestEvent *e = &ev->xconfigurerequest;
-	Container *c = find_container(i, e->window);
+	Container *c;
+	Client *cli;
+
+	/* The queue isn't where replayed events come from, and the ones merged
+	 * when recording were logged one by one anyway. */
+	merged = i->log.play != NULL ? 0 : coalesce_configure_requests(i, e);
+#ifdef PROFILE
+	if (merged > 0)
+		fprintf(stderr, "iguassu: merged %d configure requests for 0x%lx\n",
+			merged, e->window);
+#else
+	(void) merged;
+#endif
+
+	c = find_container(i, e->window);
 	if (c == NULL || !c->allow_config_req)
 		return;
 
-	XGetGeometry(i->dpy, e->window, &_dumb, &x, &y, &w, &h, &_dumbi, &_dumbi);
+	cli = model_find_in_container(c, e->window);
+	wc.x = e->value_mask & CWX ? e->x : cli->x;
+	wc.y = e->value_mask & CWY ? e->y : cli->y;
+	wc.width = e->value_mask & CWWidth ? e->width : cli->w;
+	wc.height = e->value_mask & CWHeight ? e->height : cli->h;
+
+	/* It must stay out of the screen while hidden. */
+	if (cli->offscreen) {
+		cli->hx = e->value_mask & CWX ? e->x : cli->hx;
+		cli->hy = e->value_mask & CWY ? e->y : cli->hy;
+		wc.x = i->sw;
+		wc.y = cli->hy;
+	}
 
-	x = e->value_mask & CWX ? e->x : x;
-	y = e->value_mask & CWY ? e->y : y;
-	w = e->value_mask & CWWidth ? e->width : w;
-	h = e->value_mask & CWHeight ? e->height : h;
+	set_geometry(cli, wc.x, wc.y, wc.width, wc.height);
+	mask = CWX | CWY | CWWidth | CWHeight;
+
+	/* The border is ours, it tells what's focused, so CWBorderWidth is
+	 * ignored. Stacking is fine as long as it doesn't mess with the focus
+	 * order, so only the current container may restack itself. */
+	if (c == get_current(i) && e->value_mask & CWStackMode) {
+		wc.stack_mode = e->detail;
+		mask |= CWStackMode;
+		if (e->value_mask & CWSibling && find_container(i, e->above) == c) {
+			wc.sibling = e->above;
+			mask |= CWSibling;
+		}
+	}
 
-	XMoveResizeWindow(i->dpy, e->window, x, y, w, h);
+	XConfigureWindow(i->dpy, e->window, mask, &wc);
 }
 
 void handle_event(Iguassu *i, XEvent *ev)
 {
+	TRACE_BEGIN(t);
+
+#ifdef THUMBNAILS
+	if (i->composite && ev->type == i->damage_event + XDamageNotify)
+		thumb_damaged(i, ev);
+#endif
 	switch (ev->type) {
 	case ButtonPress:
 		button_press(i, ev);
@@ -1038,17 +4292,58 @@ void handle_event(Iguassu *i, XEvent *ev)
 	case ConfigureRequest:
 		configure_request(i, ev);
 		break;
+	case ConfigureNotify:
+		configure_notify(i, ev);
+		break;
+#ifdef FOCUS_FOLLOWS_MOUSE
+	case EnterNotify:
+		enter_notify(i, ev);
+		break;
+#endif
 	}
+	TRACE_END(t, ev->type < LASTEvent && event_names[ev->type] ? event_names[ev->type] : "event");
 }
 
 void main_loop(Iguassu *i)
 {
 	XEvent ev;
+	int timeout, got;
+#if defined(FOCUS_FOLLOWS_MOUSE) || defined(THUMBNAILS)
+	int wait;
+#endif
 
 	for (;;) {
-		XSync(i->dpy, False);
-		XNextEvent(i->dpy, &ev);
-		handle_event(i, &ev);
+		resolve_results(i);
+
+		/* Not waiting at all until the menus are set up, and otherwise
+		 * only until the next spawn expires (or the entered window gets
+		 * focused, or the resolver answers). */
+		timeout = pending_expire(i);
+#ifdef FOCUS_FOLLOWS_MOUSE
+		wait = enter_expire(i);
+		if (wait >= 0 && (timeout < 0 || wait < timeout))
+			timeout = wait;
+#endif
+#ifdef THUMBNAILS
+		/* Thumbnails that are due are taken here, and the wait ends
+		 * when the next one is. */
+		wait = thumbs_update(i);
+		if (wait >= 0 && (timeout < 0 || wait < timeout))
+			timeout = wait;
+#endif
+		/* Also not when the menus need to be rendered again, which
+		 * happens once there's nothing else to do. */
+		if (i->menu_drw == NULL || menu_stale(i))
+			timeout = 0;
+		i->resolve_wakes = 1;
+		got = next_event(i, &ev, timeout);
+		i->resolve_wakes = 0;
+		if (got) {
+			handle_event(i, &ev);
+		} else {
+			menu_init(i);
+			menu_prerender(i);
+		}
 	}
 }
 
@@ -1067,21 +4362,35 @@ void scan(Iguassu *i)
 			if (wins[j] == i->menu_win || wins[j] == i->swipe_win)
 				continue;
 			if (!managed(i, wins[j]))
-				manage(i, wins[j]);
+				manage(i, wins[j], &wa);
 		}
 		if (wins)
 			XFree(wins);
 	}
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
 	Iguassu iguassu;
+	int state = -1;
+	char *rec = NULL, *play = NULL;
+
+	iguassu.argv0 = argv[0];
+	for (int a = 1; a + 1 < argc; a += 2) {
+		if (!strcmp(argv[a], "-s"))
+			state = atoi(argv[a + 1]);
+		else if (!strcmp(argv[a], "-r"))
+			rec = argv[a + 1];
+		else if (!strcmp(argv[a], "-p"))
+			play = argv[a + 1];
+	}
 
+	PHASE(NULL, NULL);
 	if (!(iguassu.dpy = XOpenDisplay(NULL)))
 		return 1;
 	if (!(iguassu.xcb_con = XGetXCBConnection(iguassu.dpy)))
 		return 1;
+	PHASE(iguassu.dpy, "connection");
 
 	iguassu.screen = DefaultScreen(iguassu.dpy);
 	iguassu.sw = DisplayWidth(iguassu.dpy, iguassu.screen);
@@ -1090,45 +4399,48 @@ int main(void)
 
 	/* I spend some time debugging stuff segfaulting because I didn't zeroed
 	 * this pointer from the beggining. */
-	iguassu.containers = NULL;
+	model_init(&iguassu.m, iguassu.sw);
+	iguassu.ops = (ModelOps) {
+		&iguassu,
+		x_map,
+		x_unmap,
+		x_focus,
+		x_border,
+		x_grab,
+		x_stack_below,
+		x_move,
+	};
+	iguassu.pool = NULL;
+	iguassu.pending = NULL;
+	iguassu.npending = 0;
+	iguassu.pending_cap = 0;
+	iguassu.resolver = NULL;
+	iguassu.resolve_wakes = 0;
+	iguassu.menu_drw = NULL;
+	iguassu.menu_win = None;
+	memset(iguassu.menu_cache, 0, sizeof(iguassu.menu_cache));
+	iguassu.menu_cache[0].gen = iguassu.menu_cache[1].gen = iguassu.m.gen - 1;
+#ifdef FOCUS_FOLLOWS_MOUSE
+	iguassu.enter_win = None;
+#endif
+#ifdef XINPUT2
+	iguassu.xi2 = 0;
+	iguassu.xi2_grabbed = 0;
+#endif
+	memset(&iguassu.log, 0, sizeof(iguassu.log));
+	iguassu.log.handling = -1;
+#ifdef AUTO_PLACE
+	memset(&iguassu.free, 0, sizeof(iguassu.free));
+#endif
 
-	/* Register to get the events. */
+	/* Register to get the events. Only what handle_event uses: the drags
+	 * and menus grab the pointer with their own masks. */
 	long mask = SubstructureRedirectMask
 		| SubstructureNotifyMask
-		| ButtonPressMask
-		| ButtonReleaseMask
-		| StructureNotifyMask
-		| PropertyChangeMask;
+		| ButtonPressMask;
 
 	XSelectInput(iguassu.dpy, iguassu.root, mask);
 
-	/* Create the menu. */
-	iguassu.menu_drw = drw_create(iguassu.dpy, iguassu.screen, iguassu.root, 10, 10);
-	if (iguassu.menu_drw == NULL)
-		return 1;
-	iguassu.menu_font = drw_fontset_create(iguassu.menu_drw, font, 1);
-	if (iguassu.menu_font == NULL)
-		return 1;
-	iguassu.menu_color = drw_scm_create(iguassu.menu_drw, menu_color, 2);
-	if (iguassu.menu_color == NULL)
-		return 1;
-	iguassu.menu_color_f = drw_scm_create(iguassu.menu_drw, menu_color_f, 2);
-	if (iguassu.menu_color_f == NULL)
-		return 1;
-
-	drw_setscheme(iguassu.menu_drw, iguassu.menu_color);
-
-	iguassu.menu_win = XCreateSimpleWindow(
-		iguassu.dpy,
-		iguassu.root,
-		0,
-		0,
-		10,
-		10,
-		BORDER_WIDTH,
-		MENU_BORDER_COLOR,
-		MENU_BACKGROUND_COLOR);
-
 	/* And the swipe. */
 	iguassu.swipe_win = XCreateSimpleWindow(
 		iguassu.dpy,
@@ -1140,6 +4452,10 @@ int main(void)
 		BORDER_WIDTH,
 		SWIPE_BORDER_COLOR,
 		SWIPE_BACKGROUND);
+	{
+		int ev, err;
+		iguassu.shape = XShapeQueryExtension(iguassu.dpy, &ev, &err);
+	}
 
 	/* Create the cursors. */
 	iguassu.cursors.left_ptr = XCreateFontCursor(iguassu.dpy, 68);
@@ -1152,6 +4468,7 @@ int main(void)
 	XClearWindow(iguassu.dpy, iguassu.root);
 #endif
 	XDefineCursor(iguassu.dpy, iguassu.root, iguassu.cursors.left_ptr);
+	PHASE(iguassu.dpy, "setup");
 
 	/* Grab keys. */
 	iguassu.fkey = XKeysymToKeycode(iguassu.dpy, FULLSCREEN_KEY);
@@ -1179,10 +4496,94 @@ int main(void)
 		GrabModeAsync,
 		GrabModeAsync);
 
+	iguassu.skey = XKeysymToKeycode(iguassu.dpy, SWITCHER_KEY);
+	XGrabKey(iguassu.dpy,
+		iguassu.skey,
+		MODMASK,
+		iguassu.root,
+		True,
+		GrabModeAsync,
+		GrabModeAsync);
+
+	iguassu.qkey = XKeysymToKeycode(iguassu.dpy, RESTART_KEY);
+	XGrabKey(iguassu.dpy,
+		iguassu.qkey,
+		MODMASK,
+		iguassu.root,
+		True,
+		GrabModeAsync,
+		GrabModeAsync);
+
+#ifdef OVERVIEW
+	iguassu.ov_win = None;
+	iguassu.okey = XKeysymToKeycode(iguassu.dpy, OVERVIEW_KEY);
+	XGrabKey(iguassu.dpy,
+		iguassu.okey,
+		MODMASK,
+		iguassu.root,
+		True,
+		GrabModeAsync,
+		GrabModeAsync);
+#endif
+
+	for (int d = 0; d < DESKTOPS; d++) {
+		iguassu.dkeys[d] = XKeysymToKeycode(iguassu.dpy, XK_1 + d);
+		XGrabKey(iguassu.dpy,
+			iguassu.dkeys[d],
+			MODMASK,
+			iguassu.root,
+			True,
+			GrabModeAsync,
+			GrabModeAsync);
+		XGrabKey(iguassu.dpy,
+			iguassu.dkeys[d],
+			MODMASK | ShiftMask,
+			iguassu.root,
+			True,
+			GrabModeAsync,
+			GrabModeAsync);
+	}
+
 	XSetErrorHandler(error_handler);
 	signal(SIGCHLD, child_handler);
+#ifdef TRACE
+	signal(SIGUSR1, trace_handler);
+#endif
+	PHASE(iguassu.dpy, "keys");
 
+	if (rec != NULL && !log_start_recording(&iguassu, rec))
+		fprintf(stderr, "iguassu: cannot record to %s\n", rec);
+	if (play != NULL && !log_start_replay(&iguassu, play)) {
+		fprintf(stderr, "iguassu: cannot replay %s\n", play);
+		return 1;
+	}
+	if (iguassu.log.play == NULL)
+		resolver_start(&iguassu);
+#ifdef COMPOSITE
+	/* The log only knows core events. */
+	iguassu.composite = 0;
+	if (iguassu.log.rec == NULL && iguassu.log.play == NULL)
+		composite_init(&iguassu);
+#endif
+#ifdef THUMBNAILS
+	thumbs_init(&iguassu);
+#endif
+#ifdef XINPUT2
+	/* The log only knows core events. */
+	if (iguassu.log.rec == NULL && iguassu.log.play == NULL)
+		xi2_init(&iguassu);
+#endif
+
+	/* We're restarting. */
+	if (state >= 0) {
+		load_state(&iguassu, state);
+		PHASE(iguassu.dpy, "state");
+	}
 	scan(&iguassu);
+	PHASE(iguassu.dpy, "scan");
+	pool_fill(&iguassu);
+
+	/* The menus are set up later, see menu_init. */
 	main_loop(&iguassu);
 
 	return 0;
@@ -0,0 +1,643 @@
+#ifndef __MODEL_INCLUDED
+#define __MODEL_INCLUDED
+
+/*
+ * model.h - The containers and clients of iguassu, without X.
+ *
+ * Everything here only touches memory: the containers list of each desktop
+ * (most recently focused first), the clients of each one (top first) and the
+ * title index.
+ * What the screen should look like is sent to a ModelOps by model_sync, so
+ * iguassu gives it one that talks to the server and anything else (like a
+ * benchmark) may give it one that just records the operations.
+ */
+
+/*
+ * Copyright (C) 2023  Gabriel de Brito
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Only for the Window type, no Xlib. */
+#include <X11/X.h>
+#include <sys/types.h>
+
+typedef struct Client {
+	char *name;
+	Window id;
+	pid_t pid;
+	/* Last switcher query that matched this client. */
+	unsigned int match;
+	/* Hidden clients may be moved out of the screen (see model_sync) and
+	 * this is where they were. */
+	short int offscreen;
+	int hx;
+	int hy;
+	/* If the buttons are grabbed to focus it on click. */
+	short int grabbed;
+	/* Geometry as the server has it, kept up to date by our own requests
+	 * and ConfigureNotify, so we never have to ask. */
+	int x;
+	int y;
+	int w;
+	int h;
+	struct Client *next;
+} Client;
+
+typedef struct Container {
+	Client *clients;
+	short int allow_config_req;
+	short int hidden;
+	int desk;
+	struct Container *next;
+	struct Container *prev;
+} Container;
+
+/* The title index maps every trigram of every title to the clients that
+ * have it. Trigrams are hashed into a fixed number of buckets, so a bucket
+ * may hold some false positives, which the query discards anyway. */
+#define TRI_BUCKETS 4096
+
+typedef struct TriBucket {
+	Client **clients;
+	int n;
+	int cap;
+} TriBucket;
+
+#ifndef DESKTOPS
+#define DESKTOPS 1
+#endif
+
+typedef struct Model {
+	/* The list of the current desktop. The others wait in desks, so each
+	 * one keeps its own focus order. */
+	Container *containers;
+	int desk;
+	Container *desks[DESKTOPS];
+	/* Where offscreen clients go. */
+	int sw;
+	TriBucket tri[TRI_BUCKETS];
+	unsigned int tri_epoch;
+	/* Goes up whenever what a menu would list changes: the order, the
+	 * names or what's hidden. */
+	unsigned int gen;
+} Model;
+
+/* Tells if ancestor started pid, directly or not. Reading the processes is
+ * up to whoever uses the model. */
+typedef int (*ModelAncestry)(void *ctx, pid_t ancestor, pid_t pid);
+
+/* What model_sync asks to be done to the windows. */
+typedef struct ModelOps {
+	void *ctx;
+	void (*map)(void *ctx, Client *c);
+	void (*unmap)(void *ctx, Client *c);
+	/* Raise and give it the input focus. */
+	void (*focus)(void *ctx, Client *c);
+	void (*border)(void *ctx, Client *c, int focused);
+	void (*grab)(void *ctx, Client *c, int grabbed);
+	void (*stack_below)(void *ctx, Client *c, Client *sibling);
+	/* The new position is already in the client. */
+	void (*move)(void *ctx, Client *c);
+} ModelOps;
+
+void model_init(Model *m, int sw);
+Container **model_head(Model *m, int desk);
+Client *model_find_in_container(Container *con, Window win);
+Client *model_find_client(Model *m, Window win);
+Container *model_find_container(Model *m, Window win);
+Container *model_current(Model *m);
+Container *model_nth(Model *m, int n);
+Container *model_nth_hidden(Model *m, int n);
+int model_n_hidden(Model *m);
+int model_n_cont(Model *m);
+int model_n_cli(Model *m);
+unsigned int model_tri_hash(const char *s);
+void model_tri_insert(Model *m, Client *c);
+void model_tri_remove(Model *m, Client *c);
+char *model_set_name(Model *m, Client *c, char *name);
+Container *model_new_container(Model *m, Window win, char *name, pid_t pid, short int allow_config_req, short int hidden);
+Client *model_add_client(Model *m, Container *c, Window win, char *name, pid_t pid);
+Client *model_remove_client(Model *m, Container *c, Window win);
+void model_raise(Model *m, Container *c);
+void model_hide(Model *m, Container *c);
+Container *model_group(Model *m, int desk, Container *except, pid_t pid, ModelAncestry is_ancestor, void *ctx);
+void model_move_to_desk(Model *m, Container *c, int desk);
+void model_sync(Model *m, ModelOps *ops, int keep_mapped);
+void model_conceal(Model *m, ModelOps *ops, Container *c, int keep_mapped);
+void model_switch(Model *m, ModelOps *ops, int desk, int keep_mapped);
+
+/* The operations, as model_sync asked them, for when there's no server. */
+#define MODEL_OP_MAP 0
+#define MODEL_OP_UNMAP 1
+#define MODEL_OP_FOCUS 2
+#define MODEL_OP_BORDER 3
+#define MODEL_OP_GRAB 4
+#define MODEL_OP_STACK_BELOW 5
+#define MODEL_OP_MOVE 6
+
+typedef struct ModelOp {
+	int op;
+	Window win;
+	/* The focused/grabbed flag, the sibling or the position. */
+	long int a;
+	long int b;
+} ModelOp;
+
+typedef struct ModelRecorder {
+	ModelOp *ops;
+	int n;
+	int cap;
+} ModelRecorder;
+
+ModelOps model_recorder_ops(ModelRecorder *r);
+
+#ifdef MODEL_IMPLEMENTATION
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+void model_init(Model *m, int sw)
+{
+	memset(m, 0, sizeof(Model));
+	m->sw = sw;
+}
+
+Container **model_head(Model *m, int desk)
+{
+	return desk == m->desk ? &m->containers : &m->desks[desk];
+}
+
+Client *model_find_in_container(Container *con, Window win)
+{
+	for (Client *c = con->clients; c != NULL; c = c->next)
+		if (c->id == win)
+			return c;
+	return NULL;
+}
+
+/* These look in every desktop, the current one first. */
+Client *model_find_client(Model *m, Window win)
+{
+	Container *c = model_find_container(m, win);
+	return c != NULL ? model_find_in_container(c, win) : NULL;
+}
+
+Container *model_find_container(Model *m, Window win)
+{
+	for (Container *c = m->containers; c != NULL; c = c->next)
+		if (model_find_in_container(c, win) != NULL)
+			return c;
+	for (int d = 0; d < DESKTOPS; d++) {
+		if (d == m->desk)
+			continue;
+		for (Container *c = m->desks[d]; c != NULL; c = c->next)
+			if (model_find_in_container(c, win) != NULL)
+				return c;
+	}
+	return NULL;
+}
+
+Container *model_current(Model *m)
+{
+	for (Container *c = m->containers; c != NULL; c = c->next)
+		if (!c->hidden)
+			return c;
+	return NULL;
+}
+
+Container *model_nth(Model *m, int n)
+{
+	Container *c;
+	for (c = m->containers; c != NULL && n > 0; c = c->next)
+		n--;
+	return c;
+}
+
+/* Counting from 1, like the hidden part of the menu. */
+Container *model_nth_hidden(Model *m, int n)
+{
+	for (Container *c = m->containers; c != NULL; c = c->next)
+		if (c->hidden && --n == 0)
+			return c;
+	return NULL;
+}
+
+int model_n_hidden(Model *m)
+{
+	int n = 0;
+	for (Container *c = m->containers; c != NULL; c = c->next)
+		if (c->hidden)
+			n++;
+	return n;
+}
+
+/* Of every desktop. */
+int model_n_cont(Model *m)
+{
+	int n = 0;
+	for (int d = 0; d < DESKTOPS; d++)
+		for (Container *c = *model_head(m, d); c != NULL; c = c->next)
+			n++;
+	return n;
+}
+
+int model_n_cli(Model *m)
+{
+	int n = 0;
+	for (int d = 0; d < DESKTOPS; d++)
+		for (Container *c = *model_head(m, d); c != NULL; c = c->next)
+			for (Client *l = c->clients; l != NULL; l = l->next)
+				n++;
+	return n;
+}
+
+unsigned int model_tri_hash(const char *s)
+{
+	unsigned int h = tolower((unsigned char) s[0]);
+	h = (h << 8) | tolower((unsigned char) s[1]);
+	h = (h << 8) | tolower((unsigned char) s[2]);
+	return (h * 2654435761u) >> 16;
+}
+
+void model_tri_insert(Model *m, Client *c)
+{
+	TriBucket *b;
+	int j;
+
+	if (c->name == NULL)
+		return;
+
+	for (const char *s = c->name; s[0] && s[1] && s[2]; s++) {
+		b = &m->tri[model_tri_hash(s) % TRI_BUCKETS];
+		/* Repeated trigrams would give duplicated entries. */
+		for (j = 0; j < b->n && b->clients[j] != c; j++)
+			;
+		if (j < b->n)
+			continue;
+
+		if (b->n == b->cap) {
+			b->cap = b->cap ? b->cap * 2 : 4;
+			b->clients = realloc(b->clients, b->cap * sizeof(Client*));
+			assert(b->clients != NULL && "Buy more ram lol");
+		}
+		b->clients[b->n++] = c;
+	}
+}
+
+void model_tri_remove(Model *m, Client *c)
+{
+	TriBucket *b;
+
+	if (c->name == NULL)
+		return;
+
+	for (const char *s = c->name; s[0] && s[1] && s[2]; s++) {
+		b = &m->tri[model_tri_hash(s) % TRI_BUCKETS];
+		for (int j = 0; j < b->n; j++) {
+			if (b->clients[j] == c) {
+				b->clients[j] = b->clients[--b->n];
+				break;
+			}
+		}
+	}
+}
+
+/* Changes the name keeping the index up to date. Returns the old one, as the
+ * model doesn't know how it was allocated. */
+char *model_set_name(Model *m, Client *c, char *name)
+{
+	char *old = c->name;
+
+	model_tri_remove(m, c);
+	c->name = name;
+	model_tri_insert(m, c);
+	m->gen++;
+	return old;
+}
+
+Container *model_new_container(Model *m, Window win, char *name, pid_t pid, short int allow_config_req, short int hidden)
+{
+	Container *c = malloc(sizeof(Container));
+	assert(c != NULL && "Buy more ram lol");
+	c->clients = malloc(sizeof(Client));
+	assert(c->clients != NULL && "Buy more ram lol");
+
+	c->prev = NULL;
+	c->next = m->containers;
+	if (m->containers != NULL)
+		m->containers->prev = c;
+	m->containers = c;
+
+	c->allow_config_req = allow_config_req;
+	c->hidden = hidden;
+	c->desk = m->desk;
+	m->gen++;
+
+	memset(c->clients, 0, sizeof(Client));
+	c->clients->id = win;
+	c->clients->name = name;
+	c->clients->pid = pid;
+	/* Every window is adopted grabbed. */
+	c->clients->grabbed = 1;
+	model_tri_insert(m, c->clients);
+
+	return c;
+}
+
+/* The new client goes to the top of the container. */
+Client *model_add_client(Model *m, Container *c, Window win, char *name, pid_t pid)
+{
+	Client *cli = malloc(sizeof(Client));
+	assert(cli != NULL && "Buy more ram lol");
+
+	memset(cli, 0, sizeof(Client));
+	cli->id = win;
+	cli->name = name;
+	cli->pid = pid;
+	cli->grabbed = 1;
+	cli->next = c->clients;
+	c->clients = cli;
+	model_tri_insert(m, cli);
+	m->gen++;
+
+	return cli;
+}
+
+/* Takes the client out of the container, and the container out of the list
+ * if it was the last one. The client is returned to be freed by the caller,
+ * name included. */
+Client *model_remove_client(Model *m, Container *c, Window win)
+{
+	Client *cli, **p;
+	Container **head = model_head(m, c->desk);
+
+	for (p = &c->clients; (cli = *p) != NULL && cli->id != win; p = &cli->next)
+		;
+	if (cli != NULL) {
+		*p = cli->next;
+		model_tri_remove(m, cli);
+	}
+	m->gen++;
+
+	if (c->clients == NULL) {
+		if (c->prev != NULL)
+			c->prev->next = c->next;
+		if (c->next != NULL)
+			c->next->prev = c->prev;
+		if (*head == c)
+			*head = c->next;
+		free(c);
+	}
+
+	return cli;
+}
+
+/* Makes it the most recently focused of the current desktop. */
+void model_raise(Model *m, Container *c)
+{
+	if (c->hidden || m->containers != c)
+		m->gen++;
+	c->hidden = 0;
+
+	if (m->containers != c) {
+		if (c->prev != NULL)
+			c->prev->next = c->next;
+		if (c->next != NULL)
+			c->next->prev = c->prev;
+		c->prev = NULL;
+		c->next = m->containers;
+		if (m->containers != NULL)
+			m->containers->prev = c;
+		m->containers = c;
+	}
+}
+
+/* It keeps its place in the focus order. */
+void model_hide(Model *m, Container *c)
+{
+	if (!c->hidden)
+		m->gen++;
+	c->hidden = 1;
+}
+
+/* The container a window of pid should go to, that is, the most recently
+ * focused one in desk whose top client started it. */
+Container *model_group(Model *m, int desk, Container *except, pid_t pid, ModelAncestry is_ancestor, void *ctx)
+{
+	for (Container *c = *model_head(m, desk); c != NULL; c = c->next) {
+		if (c == except || c->clients->pid == 0)
+			continue;
+		if (is_ancestor(ctx, c->clients->pid, pid))
+			return c;
+	}
+	return NULL;
+}
+
+/* Puts it in front of another desktop. */
+void model_move_to_desk(Model *m, Container *c, int desk)
+{
+	Container **head = model_head(m, c->desk);
+
+	m->gen++;
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	if (*head == c)
+		*head = c->next;
+
+	head = model_head(m, desk);
+	c->desk = desk;
+	c->prev = NULL;
+	c->next = *head;
+	if (*head != NULL)
+		(*head)->prev = c;
+	*head = c;
+}
+
+static void model_grab(ModelOps *ops, Client *c, int grabbed)
+{
+	if (c->grabbed == grabbed || c->id == None)
+		return;
+	ops->grab(ops->ctx, c, grabbed);
+	c->grabbed = grabbed;
+}
+
+static void model_offscreen(Model *m, ModelOps *ops, Client *c)
+{
+	if (c->offscreen || c->id == None)
+		return;
+	c->hx = c->x;
+	c->hy = c->y;
+	c->x = m->sw;
+	ops->move(ops->ctx, c);
+	c->offscreen = 1;
+}
+
+static void model_onscreen(ModelOps *ops, Client *c)
+{
+	if (!c->offscreen)
+		return;
+	c->x = c->hx;
+	c->y = c->hy;
+	ops->move(ops->ctx, c);
+	c->offscreen = 0;
+}
+
+/* Without keep_mapped, only the top client of each visible container is
+ * mapped. With it, every client stays mapped (so it doesn't have to repaint
+ * when shown again): the others of the container are stacked right below
+ * the top one and hidden containers are moved out of the screen. */
+void model_sync(Model *m, ModelOps *ops, int keep_mapped)
+{
+	Client *c;
+	int first = 1;
+
+	for (Container *con = m->containers; con != NULL; con = con->next) {
+		c = con->clients;
+
+		if (!con->hidden) {
+			if (keep_mapped) {
+				for (; c != NULL; c = c->next) {
+					model_onscreen(ops, c);
+					ops->map(ops->ctx, c);
+				}
+			} else {
+				for (c = c->next; c != NULL; c = c->next)
+					ops->unmap(ops->ctx, c);
+				ops->map(ops->ctx, con->clients);
+			}
+			c = con->clients;
+
+			if (first) {
+				ops->focus(ops->ctx, c);
+				model_grab(ops, c, 0);
+				ops->border(ops->ctx, c, 1);
+				first = 0;
+			} else {
+				model_grab(ops, c, 1);
+				ops->border(ops->ctx, c, 0);
+			}
+
+			if (keep_mapped)
+				for (; c->next != NULL; c = c->next)
+					ops->stack_below(ops->ctx, c->next, c);
+		} else {
+			model_conceal(m, ops, con, keep_mapped);
+		}
+	}
+}
+
+/* Takes every client of the container out of the screen. */
+void model_conceal(Model *m, ModelOps *ops, Container *c, int keep_mapped)
+{
+	for (Client *cli = c->clients; cli != NULL; cli = cli->next) {
+		if (keep_mapped)
+			model_offscreen(m, ops, cli);
+		else
+			ops->unmap(ops->ctx, cli);
+	}
+}
+
+/* The new desktop is shown before the old one goes away, so the background
+ * never shows in between. */
+void model_switch(Model *m, ModelOps *ops, int desk, int keep_mapped)
+{
+	Container *old = m->containers;
+
+	if (desk == m->desk || desk < 0 || desk >= DESKTOPS)
+		return;
+	m->desks[m->desk] = old;
+	m->containers = m->desks[desk];
+	m->desks[desk] = NULL;
+	m->desk = desk;
+	m->gen++;
+
+	model_sync(m, ops, keep_mapped);
+	for (Container *c = old; c != NULL; c = c->next)
+		if (!c->hidden)
+			model_conceal(m, ops, c, keep_mapped);
+}
+
+static void model_record(void *ctx, int op, Client *c, long int a, long int b)
+{
+	ModelRecorder *r = ctx;
+
+	if (r->n == r->cap) {
+		r->cap = r->cap ? r->cap * 2 : 64;
+		r->ops = realloc(r->ops, r->cap * sizeof(ModelOp));
+		assert(r->ops != NULL && "Buy more ram lol");
+	}
+	r->ops[r->n++] = (ModelOp) { op, c->id, a, b };
+}
+
+static void model_record_map(void *ctx, Client *c)
+{
+	model_record(ctx, MODEL_OP_MAP, c, 0, 0);
+}
+
+static void model_record_unmap(void *ctx, Client *c)
+{
+	model_record(ctx, MODEL_OP_UNMAP, c, 0, 0);
+}
+
+static void model_record_focus(void *ctx, Client *c)
+{
+	model_record(ctx, MODEL_OP_FOCUS, c, 0, 0);
+}
+
+static void model_record_border(void *ctx, Client *c, int focused)
+{
+	model_record(ctx, MODEL_OP_BORDER, c, focused, 0);
+}
+
+static void model_record_grab(void *ctx, Client *c, int grabbed)
+{
+	model_record(ctx, MODEL_OP_GRAB, c, grabbed, 0);
+}
+
+static void model_record_stack_below(void *ctx, Client *c, Client *sibling)
+{
+	model_record(ctx, MODEL_OP_STACK_BELOW, c, sibling->id, 0);
+}
+
+static void model_record_move(void *ctx, Client *c)
+{
+	model_record(ctx, MODEL_OP_MOVE, c, c->x, c->y);
+}
+
+ModelOps model_recorder_ops(ModelRecorder *r)
+{
+	return (ModelOps) {
+		r,
+		model_record_map,
+		model_record_unmap,
+		model_record_focus,
+		model_record_border,
+		model_record_grab,
+		model_record_stack_below,
+		model_record_move,
+	};
+}
+
+#endif /* MODEL_IMPLEMENTATION */
+
+#endif /* __MODEL_INCLUDED */